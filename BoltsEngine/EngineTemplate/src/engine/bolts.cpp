@@ -6,10 +6,41 @@
 #include "bolts.h"
 #include <vector>
 #include <iostream>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <cmath>
+#include <array>
+#include <queue>
+#include <filesystem>
+#include <future>
+#include <fstream>
+#include <cstdio>
 #include <glm/ext/matrix_clip_space.hpp>
 #include <glm/ext/matrix_transform.hpp>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BOLTS_SIMD_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BOLTS_SIMD_NEON
+#endif
 #include "bolts.h"
 
+//Tokens from GL 4.4 / extensions that the 4.1 loader header does not define
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+
 //Time variables
 float deltaTime = 0.0f;
 float lastFrameTime = 0.0f;
@@ -25,29 +56,318 @@ unsigned int shaderProgram;
 unsigned int backgroundShaderProgram;
 unsigned int backgroundVAO, backgroundVBO;
 unsigned int crosshairVAO, crosshairVBO, uiShaderProgram;
+unsigned int instancedShaderProgram;
+unsigned int depthShaderProgram;
+unsigned int shadowShaderProgram;
+unsigned int gBufferShaderProgram;
+unsigned int deferredLightingShaderProgram;
+unsigned int frameGlobalsUBO;
 GLFWwindow* window;
+int framebufferWidth = static_cast<int>(WINDOW_WIDTH), framebufferHeight = static_cast<int>(WINDOW_HEIGHT);
+
+glm::vec3 sceneLightPos = glm::vec3(0.0f, 100.0f, 0.0f); // above the scene
+Frustum viewFrustum = Frustum::fromMatrix(glm::mat4(1.0f));
+bool frustumCullingEnabled = true;
+bool occlusionCullingEnabled = false;
+bool lodEnabled = true;
+float lodPixelSize = 160.0f;
+bool depthPrepassEnabled = false;
+bool deferredShadingEnabled = false;
+bool shadowsEnabled = false;
 
 bool skyboxEnabled;
 bool gameActive;
 
-unsigned int createShaderProgram() {
-    unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertexShader, 1, &vertexShaderSource, nullptr);
-    glCompileShader(vertexShader);
+//Shader prelude
+namespace {
+    //GLSL twin of the FrameGlobals struct in bolts.h; keep the two in step
+    const char* frameGlobalsSource = R"(
+layout (std140) uniform FrameGlobals {
+    mat4 view;
+    mat4 projection;
+    mat4 viewProjection;
+    vec4 cameraPosition;
+    vec4 lightPosition;
+    vec4 clusterScale;
+    mat4 shadowMatrices[SHADOW_CASCADES];
+    vec4 cascadeSplits;
+};
+)";
+
+    //Clustered point lights and cascaded shadows for the lit fragment shaders (see
+    //initLighting and initShadows)
+    const char* lightingSource = R"(
+uniform samplerBuffer uLightData;     // per light: position and radius, then colour
+uniform usamplerBuffer uClusterGrid;  // per froxel: first index and light count
+uniform usamplerBuffer uLightIndices;
+
+vec3 pointLighting(vec3 fragPos, vec3 norm, vec3 viewDir, vec3 albedo) {
+    float depth = max(-(view * vec4(fragPos, 1.0)).z, 1e-4);
+    ivec3 cell = ivec3(gl_FragCoord.xy * clusterScale.xy, log(depth) * clusterScale.z + clusterScale.w);
+    cell = clamp(cell, ivec3(0), ivec3(CLUSTER_TILES_X - 1, CLUSTER_TILES_Y - 1, CLUSTER_SLICES - 1));
+    uvec2 range = texelFetch(uClusterGrid, (cell.z * CLUSTER_TILES_Y + cell.y) * CLUSTER_TILES_X + cell.x).xy;
+
+    vec3 result = vec3(0.0);
+    for (uint i = 0u; i < range.y; i++) {
+        int light = int(texelFetch(uLightIndices, int(range.x + i)).r);
+        vec4 positionRadius = texelFetch(uLightData, light * 2);
+        vec3 colour = texelFetch(uLightData, light * 2 + 1).rgb;
+
+        vec3 toLight = positionRadius.xyz - fragPos;
+        float distance = length(toLight);
+        float falloff = clamp(1.0 - distance / positionRadius.w, 0.0, 1.0);
+        vec3 lightDir = toLight / max(distance, 1e-4);
+        float diff = max(dot(norm, lightDir), 0.0);
+        float spec = pow(max(dot(viewDir, reflect(-lightDir, norm)), 0.0), 32);
+        result += (diff * albedo + spec) * colour * falloff * falloff;
+    }
+    return result;
+}
+
+uniform sampler2DShadow uShadowAtlas;
+
+// fraction of the scene light reaching this point; cascades by distance from the camera
+float sceneShadow(vec3 fragPos, vec3 norm) {
+    float distance = length(fragPos - cameraPosition.xyz);
+    if (distance >= cascadeSplits.w) return 1.0; // beyond the last cascade, or shadows off
+    int cascade = distance < cascadeSplits.x ? 0 : distance < cascadeSplits.y ? 1 : distance < cascadeSplits.z ? 2 : 3;
+
+    // normal offset in proportion to the cascade's texel size
+    vec4 coord = shadowMatrices[cascade] * vec4(fragPos + norm * cascadeSplits[cascade] * 0.003, 1.0);
+    return texture(uShadowAtlas, coord.xyz);
+}
+)";
 
-    unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader, 1, &fragmentShaderSource, nullptr);
-    glCompileShader(fragmentShader);
+    //Compiled ahead of every engine shader stage: the GLSL version, the engine constants the
+    //shaders size things by, and the FrameGlobals block
+    const std::string& shaderPrelude() {
+        static const std::string prelude = "#version 330 core\n"
+                "#define SHADOW_CASCADES " + std::to_string(SHADOW_CASCADES) + "\n"
+                "#define CLUSTER_TILES_X " + std::to_string(CLUSTER_TILES_X) + "\n"
+                "#define CLUSTER_TILES_Y " + std::to_string(CLUSTER_TILES_Y) + "\n"
+                "#define CLUSTER_SLICES " + std::to_string(CLUSTER_SLICES) + "\n" +
+                frameGlobalsSource;
+        return prelude;
+    }
 
-    unsigned int returnShaderProgram = glCreateProgram();
-    glAttachShader(returnShaderProgram, vertexShader);
-    glAttachShader(returnShaderProgram, fragmentShader);
-    glLinkProgram(returnShaderProgram);
+    //Engine sources leave out #version and are compiled after the prelude; sources that
+    //declare their own version (game shaders) go to the driver unchanged
+    bool usesPrelude(const char* source) {
+        source += std::strspn(source, " \t\r\n");
+        return std::strncmp(source, "#version", 8) != 0;
+    }
 
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
+    //Compiles the source, after the prelude (and for fragment stages the lighting functions)
+    //where it wants one; returns the shader
+    unsigned int compileShader(GLenum stage, const char* source) {
+        const char* parts[3];
+        GLsizei count = 0;
+        if (usesPrelude(source)) {
+            parts[count++] = shaderPrelude().c_str();
+            if (stage == GL_FRAGMENT_SHADER) parts[count++] = lightingSource;
+        }
+        parts[count++] = source;
 
-    return returnShaderProgram;
+        unsigned int shader = glCreateShader(stage);
+        glShaderSource(shader, count, parts, nullptr);
+        glCompileShader(shader);
+        return shader;
+    }
+}
+
+//Program cache
+std::string programCacheDirectory = "shader_cache";
+
+namespace {
+    //FNV-1a over raw bytes; pass a previous result as the seed to hash several ranges
+    uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+        const auto* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    //programs served from the cache and compiled from source since startup, and the
+    //time spent in buildProgram
+    int programsFromCache = 0;
+    int programsCompiled = 0;
+    double programBuildSeconds = 0.0;
+
+    bool programBinariesSupported() {
+        static const bool supported = [] {
+            if (!glGetProgramBinary || !glProgramBinary) return false;
+            GLint formats = 0;
+            glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+            return formats > 0;
+        }();
+        return supported;
+    }
+
+    std::string programCachePath(const char* vertexSource, const char* fragmentSource) {
+        uint64_t key = 14695981039346656037ULL;
+        const char* parts[] = {
+                shaderPrelude().c_str(), lightingSource, vertexSource, fragmentSource,
+                reinterpret_cast<const char*>(glGetString(GL_VENDOR)),
+                reinterpret_cast<const char*>(glGetString(GL_RENDERER)),
+                reinterpret_cast<const char*>(glGetString(GL_VERSION))
+        };
+        for (const char* part : parts) {
+            if (part) key = hashBytes(part, std::strlen(part) + 1, key); // include the terminator as a separator
+        }
+
+        char name[17];
+        std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(key));
+        return (std::filesystem::path(programCacheDirectory) / (std::string(name) + ".bin")).string();
+    }
+
+    //File layout: binary format enum, then the driver's bytes
+    bool loadCachedProgram(unsigned int program, const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) return false;
+
+        GLenum format = 0;
+        file.read(reinterpret_cast<char*>(&format), sizeof(format));
+        if (file.gcount() != static_cast<std::streamsize>(sizeof(format))) return false;
+
+        //istreambuf_iterator reads through the buffer, so the stream's eof bit says nothing here
+        std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (binary.empty()) return false;
+
+        //the driver may reject binaries from an older build of itself
+        glProgramBinary(program, format, binary.data(), static_cast<GLsizei>(binary.size()));
+        GLint linked = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        return linked == GL_TRUE;
+    }
+
+    void storeCachedProgram(unsigned int program, const std::string& path) {
+        GLint length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0) return;
+
+        std::vector<char> binary(length);
+        GLenum format = 0;
+        glGetProgramBinary(program, length, nullptr, &format, binary.data());
+
+        std::error_code error;
+        std::filesystem::create_directories(programCacheDirectory, error);
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(&format), sizeof(format));
+        file.write(binary.data(), static_cast<std::streamsize>(binary.size()));
+    }
+}
+
+namespace {
+    //programs submitted since the last finishPrograms
+    struct PendingProgram {
+        unsigned int program;
+        unsigned int vertexShader;
+        unsigned int fragmentShader;
+        std::string cachePath; // empty when the program came from the cache or caching is off
+    };
+    std::vector<PendingProgram> pendingPrograms;
+
+    typedef void (APIENTRYP PFNMAXSHADERCOMPILERTHREADSPROC)(GLuint count);
+
+    //Lets the driver compile on as many threads as it likes, where that is supported
+    void enableParallelCompile() {
+        static bool requested = false;
+        if (requested) return;
+        requested = true;
+
+        PFNMAXSHADERCOMPILERTHREADSPROC maxThreads = nullptr;
+        if (glfwExtensionSupported("GL_KHR_parallel_shader_compile")) {
+            maxThreads = reinterpret_cast<PFNMAXSHADERCOMPILERTHREADSPROC>(glfwGetProcAddress("glMaxShaderCompilerThreadsKHR"));
+        } else if (glfwExtensionSupported("GL_ARB_parallel_shader_compile")) {
+            maxThreads = reinterpret_cast<PFNMAXSHADERCOMPILERTHREADSPROC>(glfwGetProcAddress("glMaxShaderCompilerThreadsARB"));
+        }
+        if (maxThreads) maxThreads(0xFFFFFFFFu); // implementation-chosen thread count
+    }
+
+    bool checkShader(unsigned int shader, const char* stage) {
+        GLint compiled = GL_FALSE;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+        if (compiled == GL_TRUE) return true;
+
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+        std::cerr << "Failed to compile " << stage << " shader:\n" << log << std::endl;
+        return false;
+    }
+}
+
+unsigned int submitProgram(const char* vertexSource, const char* fragmentSource) {
+    double start = glfwGetTime();
+    enableParallelCompile();
+    unsigned int program = glCreateProgram();
+
+    std::string cachePath;
+    if (programBinariesSupported()) {
+        cachePath = programCachePath(vertexSource, fragmentSource);
+        if (loadCachedProgram(program, cachePath)) {
+            programsFromCache++;
+            programBuildSeconds += glfwGetTime() - start;
+            return program;
+        }
+    }
+
+    //no status queries here, so the driver can keep every submitted program in flight
+    unsigned int vertexShader = compileShader(GL_VERTEX_SHADER, vertexSource);
+    unsigned int fragmentShader = compileShader(GL_FRAGMENT_SHADER, fragmentSource);
+
+    glAttachShader(program, vertexShader);
+    glAttachShader(program, fragmentShader);
+    if (!cachePath.empty()) glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(program);
+
+    pendingPrograms.push_back({ program, vertexShader, fragmentShader, cachePath });
+    programsCompiled++;
+    programBuildSeconds += glfwGetTime() - start;
+    return program;
+}
+
+void finishPrograms() {
+    double start = glfwGetTime();
+    for (const PendingProgram& pending : pendingPrograms) {
+        bool compiled = checkShader(pending.vertexShader, "vertex");
+        compiled = checkShader(pending.fragmentShader, "fragment") && compiled;
+
+        GLint linked = GL_FALSE;
+        glGetProgramiv(pending.program, GL_LINK_STATUS, &linked);
+        if (linked != GL_TRUE && compiled) {
+            char log[1024];
+            glGetProgramInfoLog(pending.program, sizeof(log), nullptr, log);
+            std::cerr << "Failed to link shader program " << pending.program << ":\n" << log << std::endl;
+        }
+
+        glDetachShader(pending.program, pending.vertexShader);
+        glDetachShader(pending.program, pending.fragmentShader);
+        glDeleteShader(pending.vertexShader);
+        glDeleteShader(pending.fragmentShader);
+
+        if (linked == GL_TRUE && !pending.cachePath.empty()) storeCachedProgram(pending.program, pending.cachePath);
+    }
+    pendingPrograms.clear();
+    programBuildSeconds += glfwGetTime() - start;
+}
+
+unsigned int buildProgram(const char* vertexSource, const char* fragmentSource) {
+    unsigned int program = submitProgram(vertexSource, fragmentSource);
+    finishPrograms();
+    return program;
+}
+
+void logProgramStats() {
+    //a warm start serves every program from the binary cache
+    std::cout << "Shader programs ready in " << programBuildSeconds * 1000.0 << " ms ("
+              << programsFromCache << " from cache, " << programsCompiled << " compiled, "
+              << (programsCompiled == 0 ? "warm" : "cold") << " start)" << std::endl;
+}
+
+unsigned int createShaderProgram() {
+    return submitProgram(vertexShaderSource, fragmentShaderSource);
 }
 
 //mouse movement
@@ -96,83 +416,1638 @@ void mouseInput(GLFWwindow* currentWindow, double xpos, double ypos) {
 //resize
 void framebuffer_size_callback(GLFWwindow* currentWindow, int width, int height) {
     glViewport(0, 0, width, height);
+    framebufferWidth = width;
+    framebufferHeight = height;
 }
 
 //background shader program
 unsigned int createBackgroundShaderProgram() {
-    unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertexShader, 1, &backgroundVertexShader, nullptr);
-    glCompileShader(vertexShader);
+    return submitProgram(backgroundVertexShader, backgroundFragmentShader);
+}
+
+unsigned int createUIShaderProgram() {
+    return submitProgram(uiVertexShaderSource, uiFragmentShaderSource);
+}
 
-    unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader, 1, &backgroundFragmentShader, nullptr);
-    glCompileShader(fragmentShader);
+//Jobs
+
+namespace {
+    //Persistent workers (one per extra hardware thread) woken for each parallelFor call
+    class WorkerPool {
+    public:
+        WorkerPool() {
+            unsigned int cores = std::thread::hardware_concurrency();
+            for (unsigned int i = 1; i < cores; i++) {
+                workers.emplace_back([this] { workerLoop(); });
+            }
+        }
 
-    unsigned int bgShaderProgram = glCreateProgram();
-    glAttachShader(bgShaderProgram, vertexShader);
-    glAttachShader(bgShaderProgram, fragmentShader);
-    glLinkProgram(bgShaderProgram);
+        ~WorkerPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (std::thread& worker : workers) worker.join();
+        }
 
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
+        void run(int count, const std::function<void(int)>& job) {
+            if (count <= 0) return;
+            if (workers.empty() || count == 1) {
+                for (int i = 0; i < count; i++) job(i);
+                return;
+            }
 
-    return bgShaderProgram;
+            std::unique_lock<std::mutex> lock(mutex);
+            //a worker that woke late for the previous call may still be leaving it
+            finished.wait(lock, [this] { return busyWorkers == 0; });
+            currentJob = &job;
+            jobCount = count;
+            nextIndex = 0;
+            generation++;
+            lock.unlock();
+            wake.notify_all();
+
+            runIndices(job, count);
+
+            lock.lock();
+            finished.wait(lock, [this] { return busyWorkers == 0; });
+            currentJob = nullptr;
+        }
+
+    private:
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable finished;
+        const std::function<void(int)>* currentJob = nullptr;
+        int jobCount = 0;
+        unsigned int generation = 0;
+        int busyWorkers = 0;
+        bool stopping = false;
+        std::atomic<int> nextIndex{ 0 };
+
+        void runIndices(const std::function<void(int)>& job, int count) {
+            for (int i = nextIndex.fetch_add(1); i < count; i = nextIndex.fetch_add(1)) job(i);
+        }
+
+        void workerLoop() {
+            unsigned int seen = 0;
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;) {
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                if (!currentJob) continue;
+
+                const std::function<void(int)>& job = *currentJob;
+                int count = jobCount;
+                busyWorkers++;
+                lock.unlock();
+                runIndices(job, count);
+                lock.lock();
+                busyWorkers--;
+                finished.notify_all();
+            }
+        }
+    };
+
+    WorkerPool& workerPool() {
+        static WorkerPool pool;
+        return pool;
+    }
 }
 
-unsigned int createUIShaderProgram() {
-    unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertexShader, 1, &uiVertexShaderSource, nullptr);
-    glCompileShader(vertexShader);
+void parallelFor(int count, const std::function<void(int)>& job) {
+    workerPool().run(count, job);
+}
+
+//GL state cache
+//Never destroyed, so GL objects released during static destruction can still go through it
+GLStateCache& glState = *new GLStateCache();
+FrameStats frameStats;
+FrameStats lastFrameStats;
+
+void logFrameStats() {
+    std::cout << "State calls: " << lastFrameStats.stateCalls
+              << " issued, " << lastFrameStats.stateCallsFiltered << " filtered" << std::endl;
+    std::cout << "Objects: " << lastFrameStats.objectsSubmitted
+              << " submitted, " << lastFrameStats.objectsCulled << " culled, "
+              << lastFrameStats.objectsOccluded << " occluded, "
+              << lastFrameStats.trianglesSaved << " triangles saved by LOD" << std::endl;
+    std::cout << "Lights: " << lastFrameStats.lightsVisible << " visible, "
+              << lastFrameStats.lightIndices << " froxel entries" << std::endl;
+    std::cout << "Shadow casters redrawn: " << lastFrameStats.shadowCastersStatic << " static, "
+              << lastFrameStats.shadowCastersDynamic << " dynamic" << std::endl;
+    std::cout << "Resolution scale: " << lastFrameStats.resolutionScale * 100.0f << "% (scene GPU time "
+              << lastFrameStats.gpuSceneMilliseconds << " ms)" << std::endl;
+}
+
+bool GLStateCache::needsCall(bool redundant) {
+    if (redundant) {
+        frameStats.stateCallsFiltered++;
+        return false;
+    }
+    frameStats.stateCalls++;
+    return true;
+}
 
-    unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader, 1, &uiFragmentShaderSource, nullptr);
-    glCompileShader(fragmentShader);
+void GLStateCache::useProgram(unsigned int id) {
+    if (!needsCall(program == id)) return;
+    glUseProgram(id);
+    program = id;
+}
 
-    unsigned int returnShaderProgram = glCreateProgram();
-    glAttachShader(returnShaderProgram, vertexShader);
-    glAttachShader(returnShaderProgram, fragmentShader);
-    glLinkProgram(returnShaderProgram);
+void GLStateCache::bindVertexArray(unsigned int vao) {
+    if (!needsCall(vertexArray == vao)) return;
+    glBindVertexArray(vao);
+    vertexArray = vao;
 
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
+    //the element buffer binding belongs to the VAO
+    buffers.erase(GL_ELEMENT_ARRAY_BUFFER);
+}
 
-    return returnShaderProgram;
+void GLStateCache::bindBuffer(unsigned int target, unsigned int buffer) {
+    auto it = buffers.find(target);
+    if (!needsCall(it != buffers.end() && it->second == buffer)) return;
+    glBindBuffer(target, buffer);
+    buffers[target] = buffer;
 }
 
-void renderPauseMenu(unsigned int pauseShaderProgram) {
-    // Simple translucent rectangle in front of everything
-    glm::vec4 pauseOverlayColor(0.0f, 0.0f, 0.0f, 0.5f); // translucent black
+void GLStateCache::activeTexture(unsigned int unit) {
+    if (!needsCall(textureUnit == unit)) return;
+    glActiveTexture(unit);
+    textureUnit = unit;
+}
 
-    // Draw a 2D quad in NDC [-1, 1] space over screen
-    float overlayVertices[] = {
-            -0.5f,  0.3f, 0.0f,
-            -0.5f, -0.3f, 0.0f,
-            0.5f, -0.3f, 0.0f,
-
-            -0.5f,  0.3f, 0.0f,
-            0.5f, -0.3f, 0.0f,
-            0.5f,  0.3f, 0.0f,
+void GLStateCache::bindTexture(unsigned int target, unsigned int texture) {
+    //bindings are per unit; an unknown unit is resolved by selecting unit 0 explicitly
+    if (textureUnit == UNKNOWN) activeTexture(GL_TEXTURE0);
+
+    unsigned long long key = (static_cast<unsigned long long>(textureUnit) << 32) | target;
+    auto it = textures.find(key);
+    if (!needsCall(it != textures.end() && it->second == texture)) return;
+    glBindTexture(target, texture);
+    textures[key] = texture;
+}
+
+void GLStateCache::setEnabled(unsigned int capability, bool enabled) {
+    auto it = capabilities.find(capability);
+    if (!needsCall(it != capabilities.end() && it->second == enabled)) return;
+    if (enabled) glEnable(capability);
+    else glDisable(capability);
+    capabilities[capability] = enabled;
+}
+
+void GLStateCache::depthMask(bool writeDepth) {
+    if (!needsCall(depthWrite == static_cast<int>(writeDepth))) return;
+    glDepthMask(writeDepth ? GL_TRUE : GL_FALSE);
+    depthWrite = writeDepth;
+}
+
+void GLStateCache::depthFunc(unsigned int func) {
+    if (!needsCall(depthFunction == func)) return;
+    glDepthFunc(func);
+    depthFunction = func;
+}
+
+void GLStateCache::blendFunc(unsigned int source, unsigned int destination) {
+    if (!needsCall(blendSource == source && blendDestination == destination)) return;
+    glBlendFunc(source, destination);
+    blendSource = source;
+    blendDestination = destination;
+}
+
+void GLStateCache::colorMask(bool red, bool green, bool blue, bool alpha) {
+    int mask = red | green << 1 | blue << 2 | alpha << 3;
+    if (!needsCall(colorWrite == mask)) return;
+    glColorMask(red, green, blue, alpha);
+    colorWrite = mask;
+}
+
+void GLStateCache::deleteProgram(unsigned int id) {
+    if (id == 0) return;
+    glDeleteProgram(id);
+    if (program == id) program = UNKNOWN;
+}
+
+void GLStateCache::deleteVertexArray(unsigned int vao) {
+    if (vao == 0) return;
+    glDeleteVertexArrays(1, &vao);
+    if (vertexArray == vao) vertexArray = UNKNOWN;
+}
+
+void GLStateCache::deleteBuffer(unsigned int buffer) {
+    if (buffer == 0) return;
+    glDeleteBuffers(1, &buffer);
+    for (auto it = buffers.begin(); it != buffers.end();) {
+        if (it->second == buffer) it = buffers.erase(it);
+        else ++it;
+    }
+
+    //the current VAO may also have referenced it as its element buffer
+    buffers.erase(GL_ELEMENT_ARRAY_BUFFER);
+}
+
+void GLStateCache::deleteTexture(unsigned int texture) {
+    if (texture == 0) return;
+    glDeleteTextures(1, &texture);
+    for (auto it = textures.begin(); it != textures.end();) {
+        if (it->second == texture) it = textures.erase(it);
+        else ++it;
+    }
+}
+
+void GLStateCache::bindFramebuffer(unsigned int id) {
+    if (!needsCall(framebuffer == id)) return;
+    glBindFramebuffer(GL_FRAMEBUFFER, id);
+    framebuffer = id;
+}
+
+void GLStateCache::deleteFramebuffer(unsigned int id) {
+    if (id == 0) return;
+    glDeleteFramebuffers(1, &id);
+    if (framebuffer == id) framebuffer = UNKNOWN;
+}
+
+void GLStateCache::invalidate() {
+    *this = GLStateCache();
+}
+
+//Shader programs
+ShaderProgram::ShaderProgram(unsigned int programId) : id(programId) {
+    int count = 0;
+    glGetProgramiv(id, GL_ACTIVE_UNIFORMS, &count);
+
+    char name[256];
+    for (int i = 0; i < count; i++) {
+        int length = 0, size = 0;
+        GLenum type;
+        glGetActiveUniform(id, i, sizeof(name), &length, &size, &type, name);
+
+        //block members have no location and are fed through their buffer instead
+        int location = glGetUniformLocation(id, name);
+        if (location < 0) continue;
+
+        //arrays are reported as "name[0]"; register them under their plain name too
+        std::string uniformName(name, length);
+        slots[uniformName] = static_cast<int>(uniforms.size());
+        auto bracket = uniformName.find('[');
+        if (bracket != std::string::npos) slots[uniformName.substr(0, bracket)] = static_cast<int>(uniforms.size());
+
+        uniforms.push_back({ location, false, {} });
+    }
+
+    colorUniform = uniform("uColor");
+    modelUniform = uniform("uModel");
+    normalMatrixUniform = uniform("uNormalMatrix");
+    positionOriginUniform = uniform("uPositionOrigin");
+    positionExtentUniform = uniform("uPositionExtent");
+
+    //transforms and position decode default to identity so draws that never set them
+    //behave as untransformed float vertices
+    if (modelUniform >= 0 || normalMatrixUniform >= 0 || positionOriginUniform >= 0 || positionExtentUniform >= 0) {
+        use();
+        setMat4(modelUniform, glm::mat4(1.0f));
+        setMat3(normalMatrixUniform, glm::mat3(1.0f));
+        setVec3(positionOriginUniform, glm::vec3(0.0f));
+        setVec3(positionExtentUniform, glm::vec3(1.0f));
+    }
+
+    unsigned int globalsBlock = glGetUniformBlockIndex(id, "FrameGlobals");
+    if (globalsBlock != GL_INVALID_INDEX) glUniformBlockBinding(id, globalsBlock, FRAME_GLOBALS_BINDING);
+}
+
+int ShaderProgram::uniform(const std::string& name) const {
+    auto it = slots.find(name);
+    return it == slots.end() ? -1 : it->second;
+}
+
+void ShaderProgram::use() const {
+    glState.useProgram(id);
+}
+
+bool ShaderProgram::changed(int slot, const float* data, size_t count) {
+    if (slot < 0) return false;
+
+    //raw bits, not float ==, so ints stored here (and -0.0 or NaN) compare exactly
+    Uniform& cached = uniforms[slot];
+    if (cached.hasValue && std::memcmp(data, cached.value, count * sizeof(float)) == 0) return false;
+
+    std::copy(data, data + count, cached.value);
+    cached.hasValue = true;
+    return true;
+}
+
+void ShaderProgram::setInt(int slot, int value) {
+    //the cache compares raw bits, so the int is stored as-is in the float slot
+    float bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    if (changed(slot, &bits, 1)) glUniform1i(uniforms[slot].location, value);
+}
+
+void ShaderProgram::setFloat(int slot, float value) {
+    if (changed(slot, &value, 1)) glUniform1f(uniforms[slot].location, value);
+}
+
+void ShaderProgram::setVec2(int slot, const glm::vec2& value) {
+    if (changed(slot, &value[0], 2)) glUniform2fv(uniforms[slot].location, 1, &value[0]);
+}
+
+void ShaderProgram::setVec3(int slot, const glm::vec3& value) {
+    if (changed(slot, &value[0], 3)) glUniform3fv(uniforms[slot].location, 1, &value[0]);
+}
+
+void ShaderProgram::setVec4(int slot, const glm::vec4& value) {
+    if (changed(slot, &value[0], 4)) glUniform4fv(uniforms[slot].location, 1, &value[0]);
+}
+
+void ShaderProgram::setMat3(int slot, const glm::mat3& value) {
+    if (changed(slot, &value[0][0], 9)) glUniformMatrix3fv(uniforms[slot].location, 1, GL_FALSE, &value[0][0]);
+}
+
+void ShaderProgram::setMat4(int slot, const glm::mat4& value) {
+    if (changed(slot, &value[0][0], 16)) glUniformMatrix4fv(uniforms[slot].location, 1, GL_FALSE, &value[0][0]);
+}
+
+ShaderProgram& getShaderProgram(unsigned int programId) {
+    static std::vector<std::unique_ptr<ShaderProgram>> programs;
+    static ShaderProgram* last = nullptr;
+
+    if (last && last->id == programId) return *last;
+    for (auto& program : programs) {
+        if (program->id == programId) {
+            last = program.get();
+            return *last;
+        }
+    }
+
+    programs.push_back(std::make_unique<ShaderProgram>(programId));
+    last = programs.back().get();
+    return *last;
+}
+
+//Transient geometry
+namespace {
+    //glBufferStorage is GL 4.4 / ARB_buffer_storage, outside what the loader provides
+    typedef void (APIENTRYP PFNBUFFERSTORAGEPROC)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+
+    //Ring of SECTION_COUNT equal sections, one per frame in flight. With ARB_buffer_storage
+    //the whole ring is persistently mapped and each section is fenced when the CPU moves off
+    //it, so writes only ever wait if the GPU falls a full ring behind. On plain GL 3.3 the
+    //data goes in with glBufferSubData and the storage is orphaned whenever the ring wraps
+    class TransientRing {
+    public:
+        static constexpr int VERTEX_FLOATS = 10; // position, normal, colour
+        static constexpr int SECTION_COUNT = 3;
+        static constexpr int SECTION_VERTICES = 65535; // a multiple of 3, so triangles never straddle
+
+        void init() {
+            auto size = static_cast<GLsizeiptr>(SECTION_BYTES) * SECTION_COUNT;
+
+            glGenVertexArrays(1, &VAO);
+            glGenBuffers(1, &VBO);
+            glState.bindVertexArray(VAO);
+            glState.bindBuffer(GL_ARRAY_BUFFER, VBO);
+
+            PFNBUFFERSTORAGEPROC bufferStorage = nullptr;
+            if (glfwExtensionSupported("GL_ARB_buffer_storage")) {
+                bufferStorage = reinterpret_cast<PFNBUFFERSTORAGEPROC>(glfwGetProcAddress("glBufferStorage"));
+            }
+            if (bufferStorage) {
+                GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+                bufferStorage(GL_ARRAY_BUFFER, size, nullptr, flags);
+                mapped = static_cast<char*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags));
+            }
+            if (!mapped) glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_STREAM_DRAW);
+
+            GLsizei stride = VERTEX_FLOATS * sizeof(float);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)(3 * sizeof(float)));
+            glEnableVertexAttribArray(1);
+
+            //per-vertex colour in the instanced program's colour slot; the instance matrix
+            //attributes stay disabled and read the identity constants set before each draw
+            glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, stride, (void*)(6 * sizeof(float)));
+            glEnableVertexAttribArray(2);
+        }
+
+        //Copies at most SECTION_VERTICES vertices into the ring; returns the first vertex index
+        int push(const float* vertices, int vertexCount) {
+            if (head + vertexCount > SECTION_VERTICES) nextSection();
+
+            int first = section * SECTION_VERTICES + head;
+            size_t offset = static_cast<size_t>(first) * VERTEX_FLOATS * sizeof(float);
+            size_t bytes = static_cast<size_t>(vertexCount) * VERTEX_FLOATS * sizeof(float);
+
+            if (mapped) {
+                std::memcpy(mapped + offset, vertices, bytes);
+            } else {
+                glState.bindBuffer(GL_ARRAY_BUFFER, VBO);
+                glBufferSubData(GL_ARRAY_BUFFER, static_cast<GLintptr>(offset), static_cast<GLsizeiptr>(bytes), vertices);
+            }
+
+            head += vertexCount;
+            return first;
+        }
+
+        void bind() const {
+            glState.bindVertexArray(VAO);
+        }
+
+        //Retires the section written this frame so the next frame starts on a fresh one
+        void endFrame() {
+            if (head > 0) nextSection();
+        }
+
+    private:
+        static constexpr size_t SECTION_BYTES = SECTION_VERTICES * VERTEX_FLOATS * sizeof(float);
+
+        unsigned int VAO = 0;
+        unsigned int VBO = 0;
+        char* mapped = nullptr;
+        GLsync fences[SECTION_COUNT] = {};
+        int section = 0;
+        int head = 0;
+
+        void nextSection() {
+            if (mapped) {
+                fences[section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                section = (section + 1) % SECTION_COUNT;
+
+                if (fences[section]) {
+                    while (glClientWaitSync(fences[section], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {}
+                    glDeleteSync(fences[section]);
+                    fences[section] = nullptr;
+                }
+            } else {
+                section = (section + 1) % SECTION_COUNT;
+
+                //wrapped: orphan so the driver hands back fresh storage instead of syncing
+                if (section == 0) {
+                    glState.bindBuffer(GL_ARRAY_BUFFER, VBO);
+                    glBufferData(GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(SECTION_BYTES) * SECTION_COUNT,
+                                 nullptr, GL_STREAM_DRAW);
+                }
+            }
+            head = 0;
+        }
     };
 
-    unsigned int VAO, VBO;
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
-    glBindVertexArray(VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(overlayVertices), overlayVertices, GL_STATIC_DRAW);
+    TransientRing transientRing;
 
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
+    //main-program geometry held until the render queue flushes
+    std::vector<float> pendingTransientVertices;
 
-    glDisable(GL_DEPTH_TEST); // Pause screen should overlay everything
-    glUseProgram(pauseShaderProgram);
-    int colorLoc = glGetUniformLocation(pauseShaderProgram, "uColor");
-    glUniform4f(colorLoc, pauseOverlayColor.r, pauseOverlayColor.g, pauseOverlayColor.b, pauseOverlayColor.a);
-    glDrawArrays(GL_TRIANGLES, 0, 6);
-    glEnable(GL_DEPTH_TEST); // Re-enable for rest of rendering
+    void appendTransientVertices(std::vector<float>& out, glm::vec4 colour, const glm::vec3* positions,
+                                 int vertexCount, glm::vec3 offset) {
+        for (int i = 0; i < vertexCount; i++) {
+            glm::vec3 p = positions[i] + offset;
+            out.insert(out.end(), { p.x, p.y, p.z, 0.0f, 1.0f, 0.0f, colour.r, colour.g, colour.b, colour.a });
+        }
+    }
+
+    //Draws everything held for the main program through the instanced program (per-vertex
+    //colour, identity instance transform); one draw per ring section the data spans.
+    //Offsets stay baked into these vertices since they are rewritten every frame anyway
+    void drawPendingTransients() {
+        if (pendingTransientVertices.empty()) return;
+
+        ShaderProgram& program = getShaderProgram(instancedShaderProgram);
+        program.use();
+        program.setVec3(program.positionOriginUniform, glm::vec3(0.0f));
+        program.setVec3(program.positionExtentUniform, glm::vec3(1.0f));
+        transientRing.bind();
+        for (int column = 0; column < 4; column++) {
+            glm::vec4 model(0.0f);
+            model[column] = 1.0f;
+            glVertexAttrib4fv(3 + column, &model[0]);
+        }
+        for (int column = 0; column < 3; column++) {
+            glm::vec3 normal(0.0f);
+            normal[column] = 1.0f;
+            glVertexAttrib3fv(7 + column, &normal[0]);
+        }
+
+        auto total = static_cast<int>(pendingTransientVertices.size() / TransientRing::VERTEX_FLOATS);
+        for (int done = 0; done < total;) {
+            int count = std::min(total - done, TransientRing::SECTION_VERTICES);
+            int first = transientRing.push(&pendingTransientVertices[done * TransientRing::VERTEX_FLOATS], count);
+            glDrawArrays(GL_TRIANGLES, first, count);
+            done += count;
+        }
+        pendingTransientVertices.clear();
+    }
+}
+
+void drawTransient(unsigned int program, glm::vec4 colour, const glm::vec3* positions, int vertexCount,
+                   glm::vec3 offset) {
+    if (program == shaderProgram) {
+        appendTransientVertices(pendingTransientVertices, colour, positions, vertexCount, offset);
+        return;
+    }
+
+    //drawn on its own; the offset is a transform where the program has uModel, and is baked
+    //into the vertices for programs without one (the UI program, plain game shaders)
+    ShaderProgram& target = getShaderProgram(program);
+    bool bakeOffset = target.modelUniform < 0;
+    std::vector<float> vertices;
+    appendTransientVertices(vertices, colour, positions, vertexCount, bakeOffset ? offset : glm::vec3(0.0f));
+
+    target.use();
+    target.setVec4(target.colorUniform, colour);
+    target.setMat4(target.modelUniform, glm::translate(glm::mat4(1.0f), offset));
+    target.setMat3(target.normalMatrixUniform, glm::mat3(1.0f));
+    target.setVec3(target.positionOriginUniform, glm::vec3(0.0f));
+    target.setVec3(target.positionExtentUniform, glm::vec3(1.0f));
+
+    //one draw per ring section, as in drawPendingTransients
+    transientRing.bind();
+    for (int done = 0; done < vertexCount;) {
+        int count = std::min(vertexCount - done, TransientRing::SECTION_VERTICES);
+        int first = transientRing.push(&vertices[done * TransientRing::VERTEX_FLOATS], count);
+        glDrawArrays(GL_TRIANGLES, first, count);
+        done += count;
+    }
+}
+
+//Mesh batches
+namespace {
+    //Compact vertices as three 32-bit words: x|y<<16, z (high half padding), packed normal
+    std::vector<uint32_t> packCompactVertices(const IndexedMesh& mesh, glm::vec3 origin, glm::vec3 extent) {
+        auto quantise = [](float value, float start, float size) {
+            float unit = std::min(std::max((value - start) / size, 0.0f), 1.0f);
+            return static_cast<uint32_t>(std::lround(unit * 65535.0f));
+        };
+        auto packNormal = [](float value) {
+            float unit = std::min(std::max(value, -1.0f), 1.0f);
+            return static_cast<uint32_t>(static_cast<int32_t>(std::lround(unit * 511.0f))) & 0x3FFu;
+        };
+
+        std::vector<uint32_t> packed;
+        packed.reserve(mesh.vertexCount() * 3);
+        for (size_t i = 0; i < mesh.vertices.size(); i += 6) {
+            const float* v = &mesh.vertices[i];
+            packed.push_back(quantise(v[0], origin.x, extent.x) | (quantise(v[1], origin.y, extent.y) << 16));
+            packed.push_back(quantise(v[2], origin.z, extent.z));
+            packed.push_back(packNormal(v[3]) | (packNormal(v[4]) << 10) | (packNormal(v[5]) << 20));
+        }
+        return packed;
+    }
+}
+
+IndexedMesh IndexedMesh::weld(const std::vector<float>& triangleList) {
+    const size_t STRIDE = 6;
+    IndexedMesh mesh;
+    mesh.indices.reserve(triangleList.size() / STRIDE);
+
+    //vertices by hash of their bytes; equal hashes are confirmed by comparing the floats
+    std::unordered_multimap<uint64_t, uint32_t> seen;
+    for (size_t first = 0; first + STRIDE <= triangleList.size(); first += STRIDE) {
+        const float* vertex = &triangleList[first];
+        uint64_t hash = hashBytes(vertex, STRIDE * sizeof(float));
+
+        uint32_t index = UINT32_MAX;
+        auto range = seen.equal_range(hash);
+        for (auto it = range.first; it != range.second && index == UINT32_MAX; ++it) {
+            if (std::equal(vertex, vertex + STRIDE, &mesh.vertices[it->second * STRIDE])) index = it->second;
+        }
+        if (index == UINT32_MAX) {
+            index = static_cast<uint32_t>(mesh.vertexCount());
+            mesh.vertices.insert(mesh.vertices.end(), vertex, vertex + STRIDE);
+            seen.emplace(hash, index);
+        }
+        mesh.indices.push_back(index);
+    }
+    return mesh;
+}
+
+MeshBatch::MeshBatch(const std::vector<float>& triangleList, VertexFormat format)
+        : MeshBatch(IndexedMesh::weld(triangleList), format) {}
+
+MeshBatch::MeshBatch(IndexedMesh indexedMesh, VertexFormat format) : mesh(std::move(indexedMesh)), format(format) {
+    static unsigned int nextId = 0;
+    id = nextId++;
+
+    if (format == VertexFormat::Compact && mesh.vertexCount() > 0) {
+        glm::vec3 minBounds(std::numeric_limits<float>::max());
+        glm::vec3 maxBounds(std::numeric_limits<float>::lowest());
+        for (size_t i = 0; i < mesh.vertices.size(); i += 6) {
+            glm::vec3 position(mesh.vertices[i], mesh.vertices[i + 1], mesh.vertices[i + 2]);
+            minBounds = glm::min(minBounds, position);
+            maxBounds = glm::max(maxBounds, position);
+        }
+        positionOrigin = minBounds;
+        positionExtent = maxBounds - minBounds;
+        for (int axis = 0; axis < 3; axis++) {
+            if (positionExtent[axis] <= 0.0f) positionExtent[axis] = 1.0f; // flat along this axis
+        }
+    }
+}
+
+MeshBatch::~MeshBatch() {
+    glState.deleteVertexArray(VAO);
+    glState.deleteBuffer(VBO);
+    glState.deleteBuffer(EBO);
+    glState.deleteBuffer(instanceVBO);
+}
+
+std::vector<float> MeshBatch::compileShapes(const std::vector<std::shared_ptr<Shape>>& shapes) {
+    std::vector<float> interleaved;
+    for (const auto& shape : shapes) {
+        for (const auto& v : shape->getVertices()) {
+            interleaved.insert(interleaved.end(), { v.x, v.y, v.z, 0.0f, 1.0f, 0.0f });
+        }
+    }
+    return interleaved;
+}
+
+void MeshBatch::bind() {
+    if (VAO == 0) {
+        glGenVertexArrays(1, &VAO);
+        glGenBuffers(1, &VBO);
+        glGenBuffers(1, &EBO);
+        glGenBuffers(1, &instanceVBO);
+
+        glState.bindVertexArray(VAO);
+        glState.bindBuffer(GL_ARRAY_BUFFER, VBO);
+
+        if (format == VertexFormat::Compact) {
+            //4 normalised shorts (the last is padding) then one packed normal
+            glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, 12, (void*)0);
+            glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, 12, (void*)8);
+        } else {
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
+            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
+        }
+        glEnableVertexAttribArray(0);
+        glEnableVertexAttribArray(1);
+
+        //per-instance colour (2), model matrix columns (3-6) and normal matrix columns (7-9),
+        //advanced once per instance; sized for one instance up front so non-instanced draws
+        //through this VAO never see an empty buffer
+        glState.bindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+        instanceCapacity = sizeof(InstanceData);
+        glBufferData(GL_ARRAY_BUFFER, instanceCapacity, nullptr, GL_STREAM_DRAW);
+
+        auto stride = static_cast<GLsizei>(sizeof(InstanceData));
+        glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(InstanceData, colour));
+        glEnableVertexAttribArray(2);
+        glVertexAttribDivisor(2, 1);
+        for (int column = 0; column < 4; column++) {
+            size_t columnOffset = offsetof(InstanceData, model) + column * sizeof(glm::vec4);
+            glVertexAttribPointer(3 + column, 4, GL_FLOAT, GL_FALSE, stride, (void*)columnOffset);
+            glEnableVertexAttribArray(3 + column);
+            glVertexAttribDivisor(3 + column, 1);
+        }
+        for (int column = 0; column < 3; column++) {
+            size_t columnOffset = offsetof(InstanceData, normalMatrix) + column * sizeof(glm::vec3);
+            glVertexAttribPointer(7 + column, 3, GL_FLOAT, GL_FALSE, stride, (void*)columnOffset);
+            glEnableVertexAttribArray(7 + column);
+            glVertexAttribDivisor(7 + column, 1);
+        }
+    } else {
+        glState.bindVertexArray(VAO);
+    }
+
+    if (!uploaded) {
+        glState.bindBuffer(GL_ARRAY_BUFFER, VBO);
+        if (format == VertexFormat::Compact) {
+            std::vector<uint32_t> packed = packCompactVertices(mesh, positionOrigin, positionExtent);
+            glBufferData(GL_ARRAY_BUFFER, packed.size() * sizeof(uint32_t), packed.data(), GL_STATIC_DRAW);
+        } else {
+            glBufferData(GL_ARRAY_BUFFER, mesh.vertices.size() * sizeof(float), mesh.vertices.data(), GL_STATIC_DRAW);
+        }
+
+        //the element buffer binding is part of the VAO, which is bound at this point
+        glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        if (mesh.vertexCount() <= 65536) {
+            std::vector<uint16_t> shortIndices(mesh.indices.begin(), mesh.indices.end());
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, shortIndices.size() * sizeof(uint16_t), shortIndices.data(), GL_STATIC_DRAW);
+            indexType = GL_UNSIGNED_SHORT;
+        } else {
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh.indices.size() * sizeof(uint32_t), mesh.indices.data(), GL_STATIC_DRAW);
+            indexType = GL_UNSIGNED_INT;
+        }
+        uploaded = true;
+    }
+}
+
+void MeshBatch::draw() {
+    glDrawElements(GL_TRIANGLES, getIndexCount(), indexType, nullptr);
+}
+
+void MeshBatch::setDecodeUniforms(ShaderProgram& program) const {
+    program.setVec3(program.positionOriginUniform, positionOrigin);
+    program.setVec3(program.positionExtentUniform, positionExtent);
+}
+
+void MeshBatch::drawInstanced(const InstanceData* instanceData, int instanceCount) {
+    //grow the instance buffer geometrically; otherwise orphan and refill it
+    size_t bytes = instanceCount * sizeof(InstanceData);
+    glState.bindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+    if (bytes > instanceCapacity) {
+        instanceCapacity = std::max(bytes, instanceCapacity * 2);
+    }
+    glBufferData(GL_ARRAY_BUFFER, instanceCapacity, nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, instanceData);
+
+    glDrawElementsInstanced(GL_TRIANGLES, getIndexCount(), indexType, nullptr, instanceCount);
+}
 
-    glDeleteVertexArrays(1, &VAO);
-    glDeleteBuffers(1, &VBO);
+int MeshBatch::getLodCount() {
+    if (!lodsBuilt) {
+        //halve until simplification stalls (e.g. every edge is a locked border) or gets tiny
+        const int MAX_LODS = 4;
+        const size_t MIN_TRIANGLES = 8;
+        const IndexedMesh* source = &mesh;
+        while (static_cast<int>(lods.size()) < MAX_LODS - 1) {
+            size_t triangles = source->triangleCount();
+            if (triangles / 2 < MIN_TRIANGLES) break;
+
+            IndexedMesh simplified = simplifyMesh(*source, triangles / 2);
+            if (simplified.triangleCount() > triangles * 3 / 4) break;
+            optimizeMesh(simplified);
+            lods.push_back(std::make_shared<MeshBatch>(std::move(simplified), format));
+            source = &lods.back()->getMesh();
+        }
+        lodsBuilt = true;
+    }
+    return static_cast<int>(lods.size()) + 1;
+}
+
+const std::shared_ptr<MeshBatch>& MeshBatch::getLod(int level) {
+    getLodCount();
+    return lods[level - 1];
+}
+
+//Mesh simplification
+namespace {
+    //Symmetric 4x4 plane error matrix; upper triangle as xx xy xz xw yy yz yw zz zw ww
+    struct Quadric {
+        double m[10] = {};
+
+        void addPlane(const glm::vec3& normal, float d, double weight) {
+            double plane[4] = { normal.x, normal.y, normal.z, d };
+            int k = 0;
+            for (int i = 0; i < 4; i++) {
+                for (int j = i; j < 4; j++) m[k++] += plane[i] * plane[j] * weight;
+            }
+        }
+
+        Quadric& operator+=(const Quadric& other) {
+            for (int i = 0; i < 10; i++) m[i] += other.m[i];
+            return *this;
+        }
+
+        [[nodiscard]] double error(const glm::vec3& point) const {
+            double p[3] = { point.x, point.y, point.z };
+            return m[0] * p[0] * p[0] + 2 * m[1] * p[0] * p[1] + 2 * m[2] * p[0] * p[2] + 2 * m[3] * p[0]
+                 + m[4] * p[1] * p[1] + 2 * m[5] * p[1] * p[2] + 2 * m[6] * p[1]
+                 + m[7] * p[2] * p[2] + 2 * m[8] * p[2]
+                 + m[9];
+        }
+    };
+
+    struct Collapse {
+        double cost;
+        uint32_t kept, removed;
+        uint32_t keptVersion, removedVersion;
+        glm::vec3 position;
+
+        bool operator>(const Collapse& other) const { return cost > other.cost; }
+    };
+
+    //border planes are weighted this much more than surface planes
+    const double BORDER_WEIGHT = 1000.0;
+}
+
+IndexedMesh simplifyMesh(const IndexedMesh& mesh, size_t targetTriangles) {
+    const size_t STRIDE = 6;
+    size_t cornerCount = mesh.indices.size();
+    if (mesh.triangleCount() <= targetTriangles) return mesh;
+
+    //weld corners with identical positions (differing normals too); the first normal is kept
+    std::vector<uint32_t> order(cornerCount);
+    for (uint32_t i = 0; i < cornerCount; i++) order[i] = i;
+    auto position = [&](uint32_t corner) { return &mesh.vertices[mesh.indices[corner] * STRIDE]; };
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return std::lexicographical_compare(position(a), position(a) + 3, position(b), position(b) + 3);
+    });
+
+    std::vector<uint32_t> cornerVertex(cornerCount);
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    for (size_t i = 0; i < cornerCount; i++) {
+        const float* p = position(order[i]);
+        if (i == 0 || !std::equal(p, p + 3, position(order[i - 1]))) {
+            positions.emplace_back(p[0], p[1], p[2]);
+            normals.emplace_back(p[3], p[4], p[5]);
+        }
+        cornerVertex[order[i]] = static_cast<uint32_t>(positions.size() - 1);
+    }
+
+    std::vector<std::array<uint32_t, 3>> triangles;
+    for (size_t corner = 0; corner + 2 < cornerCount; corner += 3) {
+        std::array<uint32_t, 3> triangle = { cornerVertex[corner], cornerVertex[corner + 1], cornerVertex[corner + 2] };
+        if (triangle[0] == triangle[1] || triangle[1] == triangle[2] || triangle[0] == triangle[2]) continue;
+        triangles.push_back(triangle);
+    }
+
+    size_t vertexCount = positions.size();
+    std::vector<Quadric> quadrics(vertexCount);
+    std::vector<std::vector<uint32_t>> vertexTriangles(vertexCount);
+    std::unordered_map<uint64_t, int> edgeUses;
+    auto edgeKey = [](uint32_t a, uint32_t b) {
+        return (static_cast<uint64_t>(std::min(a, b)) << 32) | std::max(a, b);
+    };
+
+    for (uint32_t t = 0; t < triangles.size(); t++) {
+        const auto& triangle = triangles[t];
+        glm::vec3 a = positions[triangle[0]], b = positions[triangle[1]], c = positions[triangle[2]];
+        glm::vec3 cross = glm::cross(b - a, c - a);
+        float length = glm::length(cross);
+        if (length > 0.0f) {
+            glm::vec3 normal = cross / length;
+            for (uint32_t v : triangle) quadrics[v].addPlane(normal, -glm::dot(normal, a), length * 0.5);
+        }
+        for (int i = 0; i < 3; i++) {
+            vertexTriangles[triangle[i]].push_back(t);
+            edgeUses[edgeKey(triangle[i], triangle[(i + 1) % 3])]++;
+        }
+    }
+
+    //open borders get a plane through the edge, perpendicular to its face
+    for (const auto& triangle : triangles) {
+        glm::vec3 a = positions[triangle[0]], b = positions[triangle[1]], c = positions[triangle[2]];
+        glm::vec3 faceNormal = glm::cross(b - a, c - a);
+        if (glm::length(faceNormal) == 0.0f) continue;
+        faceNormal = glm::normalize(faceNormal);
+
+        for (int i = 0; i < 3; i++) {
+            uint32_t from = triangle[i], to = triangle[(i + 1) % 3];
+            if (edgeUses[edgeKey(from, to)] != 1) continue;
+
+            glm::vec3 start = positions[from], edge = positions[to] - start;
+            glm::vec3 borderNormal = glm::cross(edge, faceNormal);
+            float length = glm::length(borderNormal);
+            if (length == 0.0f) continue;
+            borderNormal /= length;
+            double weight = BORDER_WEIGHT * glm::dot(edge, edge);
+            quadrics[from].addPlane(borderNormal, -glm::dot(borderNormal, start), weight);
+            quadrics[to].addPlane(borderNormal, -glm::dot(borderNormal, start), weight);
+        }
+    }
+
+    std::vector<bool> triangleAlive(triangles.size(), true);
+    std::vector<bool> vertexRemoved(vertexCount, false);
+    std::vector<uint32_t> versions(vertexCount, 0);
+    std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> candidates;
+
+    //cheapest of the two endpoints and the midpoint under the combined quadric
+    auto pushCandidate = [&](uint32_t a, uint32_t b) {
+        Quadric combined = quadrics[a];
+        combined += quadrics[b];
+        glm::vec3 options[3] = { positions[a], positions[b], (positions[a] + positions[b]) * 0.5f };
+        Collapse best{ std::numeric_limits<double>::max(), a, b, versions[a], versions[b], options[0] };
+        for (const glm::vec3& option : options) {
+            double cost = combined.error(option);
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.position = option;
+            }
+        }
+        candidates.push(best);
+    };
+
+    for (const auto& triangle : triangles) {
+        for (int i = 0; i < 3; i++) {
+            if (triangle[i] < triangle[(i + 1) % 3]) pushCandidate(triangle[i], triangle[(i + 1) % 3]);
+        }
+    }
+
+    //rejects a collapse that would turn any surviving face of either end around
+    auto flipsFace = [&](uint32_t kept, uint32_t removed, const glm::vec3& target) {
+        for (uint32_t moved : { kept, removed }) {
+            for (uint32_t t : vertexTriangles[moved]) {
+                if (!triangleAlive[t]) continue;
+                const auto& triangle = triangles[t];
+                bool hasKept = std::find(triangle.begin(), triangle.end(), kept) != triangle.end();
+                bool hasRemoved = std::find(triangle.begin(), triangle.end(), removed) != triangle.end();
+                if (hasKept && hasRemoved) continue; // collapses away
+
+                glm::vec3 before[3], after[3];
+                for (int i = 0; i < 3; i++) {
+                    before[i] = positions[triangle[i]];
+                    after[i] = triangle[i] == moved ? target : before[i];
+                }
+                glm::vec3 oldNormal = glm::cross(before[1] - before[0], before[2] - before[0]);
+                glm::vec3 newNormal = glm::cross(after[1] - after[0], after[2] - after[0]);
+                if (glm::dot(oldNormal, newNormal) <= 0.0f) return true;
+            }
+        }
+        return false;
+    };
+
+    size_t liveTriangles = triangles.size();
+    while (liveTriangles > targetTriangles && !candidates.empty()) {
+        Collapse collapse = candidates.top();
+        candidates.pop();
+        uint32_t kept = collapse.kept, removed = collapse.removed;
+        if (vertexRemoved[kept] || vertexRemoved[removed]) continue;
+        if (versions[kept] != collapse.keptVersion || versions[removed] != collapse.removedVersion) continue;
+        if (flipsFace(kept, removed, collapse.position)) continue;
+
+        positions[kept] = collapse.position;
+        quadrics[kept] += quadrics[removed];
+        vertexRemoved[removed] = true;
+        versions[kept]++;
+
+        for (uint32_t t : vertexTriangles[removed]) {
+            if (!triangleAlive[t]) continue;
+            auto& triangle = triangles[t];
+            if (std::find(triangle.begin(), triangle.end(), kept) != triangle.end()) {
+                triangleAlive[t] = false;
+                liveTriangles--;
+            } else {
+                std::replace(triangle.begin(), triangle.end(), removed, kept);
+                vertexTriangles[kept].push_back(t);
+            }
+        }
+        vertexTriangles[removed].clear();
+
+        //re-cost every edge around the moved vertex
+        auto& around = vertexTriangles[kept];
+        around.erase(std::remove_if(around.begin(), around.end(), [&](uint32_t t) { return !triangleAlive[t]; }),
+                     around.end());
+        for (uint32_t t : around) {
+            for (uint32_t neighbour : triangles[t]) {
+                if (neighbour != kept) pushCandidate(kept, neighbour);
+            }
+        }
+    }
+
+    //surviving vertices are renumbered in order of first use
+    IndexedMesh simplified;
+    simplified.indices.reserve(liveTriangles * 3);
+    std::vector<uint32_t> remap(vertexCount, UINT32_MAX);
+    for (size_t t = 0; t < triangles.size(); t++) {
+        if (!triangleAlive[t]) continue;
+        for (uint32_t v : triangles[t]) {
+            if (remap[v] == UINT32_MAX) {
+                remap[v] = static_cast<uint32_t>(simplified.vertexCount());
+                const glm::vec3& p = positions[v];
+                const glm::vec3& n = normals[v];
+                simplified.vertices.insert(simplified.vertices.end(), { p.x, p.y, p.z, n.x, n.y, n.z });
+            }
+            simplified.indices.push_back(remap[v]);
+        }
+    }
+    return simplified;
+}
+
+//Vertex cache optimisation
+namespace {
+    const int FORSYTH_CACHE_SIZE = 32;
+
+    //Vertices of the last triangle get a flat score so the next triangle does not simply
+    //reuse two of them; older entries fall off with cache position. Vertices with few
+    //triangles left are boosted so isolated triangles do not get stranded
+    float forsythVertexScore(int cachePosition, uint32_t remainingTriangles) {
+        if (remainingTriangles == 0) return -1.0f;
+
+        float score = 0.0f;
+        if (cachePosition >= 0) {
+            if (cachePosition < 3) {
+                score = 0.75f;
+            } else {
+                float scale = 1.0f / static_cast<float>(FORSYTH_CACHE_SIZE - 3);
+                score = std::pow(1.0f - static_cast<float>(cachePosition - 3) * scale, 1.5f);
+            }
+        }
+        return score + 2.0f / std::sqrt(static_cast<float>(remainingTriangles));
+    }
+}
+
+void optimizeMesh(IndexedMesh& mesh) {
+    size_t vertexCount = mesh.vertexCount();
+    size_t triangleCount = mesh.triangleCount();
+    if (triangleCount == 0) return;
+
+    //triangles still to emit around each vertex, packed into one array
+    std::vector<uint32_t> remaining(vertexCount, 0);
+    for (uint32_t index : mesh.indices) remaining[index]++;
+    std::vector<uint32_t> firstTriangle(vertexCount + 1, 0);
+    for (size_t v = 0; v < vertexCount; v++) firstTriangle[v + 1] = firstTriangle[v] + remaining[v];
+    std::vector<uint32_t> vertexTriangles(mesh.indices.size());
+    std::vector<uint32_t> fill(firstTriangle.begin(), firstTriangle.end() - 1);
+    for (size_t i = 0; i < mesh.indices.size(); i++) {
+        vertexTriangles[fill[mesh.indices[i]]++] = static_cast<uint32_t>(i / 3);
+    }
+
+    std::vector<int> cachePosition(vertexCount, -1);
+    std::vector<float> vertexScore(vertexCount);
+    for (size_t v = 0; v < vertexCount; v++) vertexScore[v] = forsythVertexScore(-1, remaining[v]);
+
+    std::vector<float> triangleScore(triangleCount);
+    std::vector<bool> emitted(triangleCount, false);
+    for (size_t t = 0; t < triangleCount; t++) {
+        triangleScore[t] = vertexScore[mesh.indices[t * 3]] + vertexScore[mesh.indices[t * 3 + 1]]
+                         + vertexScore[mesh.indices[t * 3 + 2]];
+    }
+
+    std::vector<uint32_t> cache, nextCache;
+    std::vector<uint32_t> ordered;
+    ordered.reserve(mesh.indices.size());
+    size_t scanCursor = 0;
+    int64_t best = -1;
+
+    for (size_t emittedCount = 0; emittedCount < triangleCount; emittedCount++) {
+        //nothing around the cache to continue with: take the next unemitted triangle
+        if (best < 0) {
+            while (emitted[scanCursor]) scanCursor++;
+            best = static_cast<int64_t>(scanCursor);
+        }
+
+        const uint32_t* triangle = &mesh.indices[best * 3];
+        ordered.insert(ordered.end(), triangle, triangle + 3);
+        emitted[best] = true;
+
+        //drop the triangle from its vertices' lists
+        for (int i = 0; i < 3; i++) {
+            uint32_t v = triangle[i];
+            uint32_t* begin = &vertexTriangles[firstTriangle[v]];
+            uint32_t* end = begin + remaining[v];
+            *std::find(begin, end, static_cast<uint32_t>(best)) = *(end - 1);
+            remaining[v]--;
+        }
+
+        //its vertices move to the front of the LRU cache
+        nextCache.assign(triangle, triangle + 3);
+        for (uint32_t v : cache) {
+            if (v != triangle[0] && v != triangle[1] && v != triangle[2]) nextCache.push_back(v);
+        }
+        for (size_t i = 0; i < nextCache.size(); i++) {
+            cachePosition[nextCache[i]] = i < static_cast<size_t>(FORSYTH_CACHE_SIZE) ? static_cast<int>(i) : -1;
+        }
+
+        //rescore everything that moved and pick the best triangle touching the cache
+        best = -1;
+        float bestScore = -1.0f;
+        for (uint32_t v : nextCache) {
+            vertexScore[v] = forsythVertexScore(cachePosition[v], remaining[v]);
+        }
+        for (uint32_t v : nextCache) {
+            for (uint32_t i = 0; i < remaining[v]; i++) {
+                uint32_t t = vertexTriangles[firstTriangle[v] + i];
+                triangleScore[t] = vertexScore[mesh.indices[t * 3]] + vertexScore[mesh.indices[t * 3 + 1]]
+                                 + vertexScore[mesh.indices[t * 3 + 2]];
+                if (cachePosition[v] >= 0 && triangleScore[t] > bestScore) {
+                    bestScore = triangleScore[t];
+                    best = t;
+                }
+            }
+        }
+
+        if (nextCache.size() > static_cast<size_t>(FORSYTH_CACHE_SIZE)) nextCache.resize(FORSYTH_CACHE_SIZE);
+        std::swap(cache, nextCache);
+    }
+
+    //renumber vertices by first use so the vertex buffer is read front to back
+    std::vector<uint32_t> remap(vertexCount, UINT32_MAX);
+    std::vector<float> vertices;
+    vertices.reserve(mesh.vertices.size());
+    for (uint32_t& index : ordered) {
+        if (remap[index] == UINT32_MAX) {
+            remap[index] = static_cast<uint32_t>(vertices.size() / 6);
+            vertices.insert(vertices.end(), &mesh.vertices[index * 6], &mesh.vertices[index * 6] + 6);
+        }
+        index = remap[index];
+    }
+    mesh.vertices = std::move(vertices);
+    mesh.indices = std::move(ordered);
+}
+
+float computeACMR(const IndexedMesh& mesh, int cacheSize) {
+    if (mesh.indices.empty()) return 0.0f;
+
+    //a vertex is cached if it missed within the last cacheSize misses
+    std::vector<uint64_t> missedAt(mesh.vertexCount(), 0);
+    uint64_t misses = 0;
+    for (uint32_t index : mesh.indices) {
+        if (missedAt[index] == 0 || misses + 1 - missedAt[index] > static_cast<uint64_t>(cacheSize)) {
+            misses++;
+            missedAt[index] = misses;
+        }
+    }
+    return static_cast<float>(misses) / static_cast<float>(mesh.triangleCount());
+}
+
+//Instanced rendering
+namespace {
+    //totals over every batch registerMesh has built, for logMeshStats
+    size_t registeredTriangles = 0;
+    double registeredMissesBefore = 0.0;
+    double registeredMissesAfter = 0.0;
+
+    //the welded, unoptimised geometry a batch was built from, so lookups can skip optimizeMesh
+    struct RegisteredMesh {
+        IndexedMesh source;
+        VertexFormat format;
+        std::weak_ptr<MeshBatch> batch;
+    };
+
+    //live batches by source geometry hash; expired entries are pruned as they are encountered
+    std::unordered_multimap<uint64_t, RegisteredMesh> meshRegistry;
+}
+
+std::shared_ptr<MeshBatch> registerMesh(const std::vector<std::shared_ptr<Shape>>& shapes, VertexFormat format) {
+    IndexedMesh source = IndexedMesh::weld(MeshBatch::compileShapes(shapes));
+    uint64_t hash = hashBytes(source.vertices.data(), source.vertices.size() * sizeof(float));
+    hash = hashBytes(source.indices.data(), source.indices.size() * sizeof(uint32_t), hash);
+
+    auto range = meshRegistry.equal_range(hash);
+    for (auto it = range.first; it != range.second;) {
+        if (auto existing = it->second.batch.lock()) {
+            if (it->second.format == format && it->second.source == source) return existing;
+            ++it;
+        } else {
+            it = meshRegistry.erase(it);
+        }
+    }
+
+    IndexedMesh mesh = source;
+    optimizeMesh(mesh);
+    registeredTriangles += mesh.triangleCount();
+    registeredMissesBefore += computeACMR(source) * static_cast<double>(mesh.triangleCount());
+    registeredMissesAfter += computeACMR(mesh) * static_cast<double>(mesh.triangleCount());
+
+    auto batch = std::make_shared<MeshBatch>(std::move(mesh), format);
+    meshRegistry.emplace(hash, RegisteredMesh{ std::move(source), format, batch });
+    return batch;
+}
+
+void logMeshStats() {
+    if (registeredTriangles == 0) return;
+    auto triangles = static_cast<double>(registeredTriangles);
+    std::cout << "Meshes: " << registeredTriangles << " triangles, ACMR "
+              << registeredMissesBefore / triangles << " before optimisation, "
+              << registeredMissesAfter / triangles << " after" << std::endl;
+}
+
+InstanceData InstanceData::make(const glm::mat4& model, glm::vec4 colour) {
+    return { model, colour, glm::transpose(glm::inverse(glm::mat3(model))) };
+}
+
+void submitInstance(const std::shared_ptr<MeshBatch>& batch, const glm::mat4& model, glm::vec4 colour) {
+    RenderPass pass = colour.a < 1.0f ? RenderPass::Translucent : RenderPass::Opaque;
+    submitRenderCommand(pass, instancedShaderProgram, batch, model, colour);
+}
+
+void submitInstance(const std::shared_ptr<MeshBatch>& batch, glm::vec3 offset, glm::vec4 colour) {
+    submitInstance(batch, glm::translate(glm::mat4(1.0f), offset), colour);
+}
+
+//Render queue
+namespace {
+    struct RenderCommand {
+        RenderPass pass;
+        unsigned int program;
+        bool instanced;
+        std::shared_ptr<MeshBatch> batch;
+        InstanceData instance;
+    };
+
+    struct SortEntry {
+        uint64_t key;
+        uint32_t index;
+    };
+
+    std::vector<RenderCommand> renderCommands;
+    std::vector<SortEntry> sortEntries;
+    std::vector<SortEntry> sortScratch;
+
+    //distances beyond the far plane all share the last depth bucket
+    const float SORT_DEPTH_RANGE = CAMERA_FAR;
+    const uint64_t DEPTH_BITS = 24;
+    const uint64_t DEPTH_MAX = (1ULL << DEPTH_BITS) - 1;
+
+    //Layout, high to low bits:
+    //  opaque:      pass(2) | program(8) | mesh(20) | depth(24)         -> state first, then front-to-back
+    //  translucent: pass(2) | inverse depth(24) | program(8) | mesh(20) -> back-to-front first
+    uint64_t makeSortKey(RenderPass pass, unsigned int program, unsigned int mesh, float distance) {
+        auto depth = static_cast<uint64_t>(glm::clamp(distance / SORT_DEPTH_RANGE, 0.0f, 1.0f) * DEPTH_MAX);
+        uint64_t key = static_cast<uint64_t>(pass) << 62;
+        uint64_t programBits = program & 0xFF;
+        uint64_t meshBits = mesh & 0xFFFFF;
+
+        if (pass == RenderPass::Opaque) {
+            key |= programBits << 54 | meshBits << 34 | depth << 10;
+        } else {
+            key |= (DEPTH_MAX - depth) << 38 | programBits << 30 | meshBits << 10;
+        }
+        return key;
+    }
+
+    //LSD radix sort, one byte per pass; bytes identical across all keys are skipped
+    void radixSort(std::vector<SortEntry>& entries, std::vector<SortEntry>& scratch) {
+        if (entries.size() < 2) return;
+        scratch.resize(entries.size());
+
+        for (int shift = 0; shift < 64; shift += 8) {
+            size_t counts[256] = {};
+            for (const auto& entry : entries) counts[(entry.key >> shift) & 0xFF]++;
+            if (counts[(entries[0].key >> shift) & 0xFF] == entries.size()) continue;
+
+            size_t offsets[256];
+            size_t total = 0;
+            for (int i = 0; i < 256; i++) {
+                offsets[i] = total;
+                total += counts[i];
+            }
+            for (const auto& entry : entries) scratch[offsets[(entry.key >> shift) & 0xFF]++] = entry;
+            entries.swap(scratch);
+        }
+    }
+
+    //After a depth pre-pass the opaque pass only tests against the depth already laid down
+    void applyPassState(RenderPass pass, bool depthPrepassed = false) {
+        if (pass == RenderPass::Opaque) {
+            glState.enable(GL_DEPTH_TEST);
+            glState.depthMask(!depthPrepassed);
+            glState.depthFunc(depthPrepassed ? GL_LEQUAL : GL_LESS);
+            glState.disable(GL_BLEND);
+            return;
+        }
+        if (pass == RenderPass::Sky) {
+            //sky geometry sits on the far plane, where the cleared depth is exactly 1
+            glState.enable(GL_DEPTH_TEST);
+            glState.depthMask(false);
+            glState.depthFunc(GL_LEQUAL);
+            glState.disable(GL_BLEND);
+            return;
+        }
+
+        glState.depthFunc(GL_LESS);
+        glState.enable(GL_BLEND);
+        glState.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glState.depthMask(false);
+        glState.setEnabled(GL_DEPTH_TEST, pass != RenderPass::Overlay);
+    }
+}
+
+namespace {
+    //set by engineBeginFrame, cleared once the sky is drawn
+    bool skyPending = false;
+
+    void drawSky() {
+        if (!skyPending) return;
+        skyPending = false;
+
+        applyPassState(RenderPass::Sky);
+        if (skyboxEnabled) renderSkybox();
+        else renderBackground();
+    }
+
+    //Lays down depth for the opaque commands at the front of the sorted queue, one
+    //instanced draw per run of the same mesh whatever program the lit pass uses.
+    //Returns false if there was nothing opaque to draw
+    bool drawDepthPrepass(std::vector<InstanceData>& instanceData) {
+        if (sortEntries.empty() || renderCommands[sortEntries[0].index].pass != RenderPass::Opaque) return false;
+
+        ShaderProgram& program = getShaderProgram(depthShaderProgram);
+        program.use();
+        applyPassState(RenderPass::Opaque);
+        glState.colorMask(false, false, false, false);
+
+        for (size_t i = 0; i < sortEntries.size();) {
+            const RenderCommand& command = renderCommands[sortEntries[i].index];
+            if (command.pass != RenderPass::Opaque) break;
+
+            instanceData.clear();
+            size_t end = i;
+            for (; end < sortEntries.size(); end++) {
+                const RenderCommand& next = renderCommands[sortEntries[end].index];
+                if (next.pass != RenderPass::Opaque || next.batch != command.batch) break;
+                instanceData.push_back(next.instance);
+            }
+            command.batch->bind();
+            command.batch->setDecodeUniforms(program);
+            command.batch->drawInstanced(instanceData.data(), static_cast<int>(end - i));
+            i = end;
+        }
+
+        glState.colorMask(true, true, true, true);
+        return true;
+    }
+}
+
+//Deferred shading
+namespace {
+    //albedo (RGBA8), normal (RGB10_A2, remapped to 0..1) and depth; sized to the framebuffer
+    unsigned int gBuffer = 0;
+    unsigned int gBufferTextures[3];
+    int gBufferWidth = 0, gBufferHeight = 0;
+    int inverseViewProjectionSlot = -1;
+    int viewportSizeSlot = -1;
+
+    //set by engineBeginFrame; the lighting pass rebuilds world positions from depth with it
+    glm::mat4 deferredInverseViewProjection(1.0f);
+
+    bool resizeGBuffer(int width, int height) {
+        if (width == gBufferWidth && height == gBufferHeight) return true;
+        gBufferWidth = width;
+        gBufferHeight = height;
+
+        const GLenum internalFormats[3] = { GL_RGBA8, GL_RGB10_A2, GL_DEPTH_COMPONENT24 };
+        const GLenum formats[3] = { GL_RGBA, GL_RGBA, GL_DEPTH_COMPONENT };
+        const GLenum types[3] = { GL_UNSIGNED_BYTE, GL_UNSIGNED_INT_2_10_10_10_REV, GL_UNSIGNED_INT };
+        const GLenum attachments[3] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_DEPTH_ATTACHMENT };
+
+        glState.bindFramebuffer(gBuffer);
+        for (int i = 0; i < 3; i++) {
+            glState.activeTexture(GL_TEXTURE0 + GBUFFER_TEXTURE_UNIT + i);
+            glState.bindTexture(GL_TEXTURE_2D, gBufferTextures[i]);
+            glTexImage2D(GL_TEXTURE_2D, 0, internalFormats[i], width, height, 0, formats[i], types[i], nullptr);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, attachments[i], GL_TEXTURE_2D, gBufferTextures[i], 0);
+        }
+        glState.activeTexture(GL_TEXTURE0);
+        glDrawBuffers(2, attachments);
+
+        bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+        glState.bindFramebuffer(0);
+        return complete;
+    }
+
+    bool isDeferred(const RenderCommand& command) {
+        return command.pass == RenderPass::Opaque &&
+               (command.program == instancedShaderProgram || command.program == shaderProgram);
+    }
+
+    //True if any command in the opaque range at the front of the sorted queue can be deferred;
+    //the sort key orders by program, so they need not come first
+    bool hasDeferredCommands() {
+        for (const SortEntry& entry : sortEntries) {
+            const RenderCommand& command = renderCommands[entry.index];
+            if (command.pass != RenderPass::Opaque) break;
+            if (isDeferred(command)) return true;
+        }
+        return false;
+    }
+
+    //Fills the G-buffer from the deferred commands in the opaque range of the sorted queue,
+    //one instanced draw per run of the same mesh, then lights it into the default framebuffer.
+    //Returns false if there was nothing to defer
+    bool drawDeferredOpaque(std::vector<InstanceData>& instanceData) {
+        if (!hasDeferredCommands()) return false;
+        if (framebufferWidth <= 0 || framebufferHeight <= 0) return false;
+        if (!resizeGBuffer(framebufferWidth, framebufferHeight)) {
+            std::cerr << "G-buffer incomplete; falling back to forward shading" << std::endl;
+            deferredShadingEnabled = false;
+            return false;
+        }
+
+        glState.bindFramebuffer(gBuffer);
+        applyPassState(RenderPass::Opaque);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        ShaderProgram& program = getShaderProgram(gBufferShaderProgram);
+        program.use();
+        for (size_t i = 0; i < sortEntries.size();) {
+            const RenderCommand& command = renderCommands[sortEntries[i].index];
+            if (command.pass != RenderPass::Opaque) break;
+            if (!isDeferred(command)) {
+                i++;
+                continue;
+            }
+
+            instanceData.clear();
+            size_t end = i;
+            for (; end < sortEntries.size(); end++) {
+                const RenderCommand& next = renderCommands[sortEntries[end].index];
+                if (!isDeferred(next) || next.batch != command.batch) break;
+                instanceData.push_back(next.instance);
+            }
+            command.batch->bind();
+            command.batch->setDecodeUniforms(program);
+            command.batch->drawInstanced(instanceData.data(), static_cast<int>(end - i));
+            i = end;
+        }
+        glState.bindFramebuffer(sceneFramebuffer);
+
+        //once per pixel; the shader discards empty pixels and writes the G-buffer depth
+        ShaderProgram& lighting = getShaderProgram(deferredLightingShaderProgram);
+        lighting.use();
+        lighting.setMat4(inverseViewProjectionSlot, deferredInverseViewProjection);
+        lighting.setVec2(viewportSizeSlot, glm::vec2(renderWidth, renderHeight));
+        glState.bindVertexArray(backgroundVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        return true;
+    }
+}
+
+void initDeferredShading() {
+    glGenFramebuffers(1, &gBuffer);
+    glGenTextures(3, gBufferTextures);
+
+    ShaderProgram& program = getShaderProgram(deferredLightingShaderProgram);
+    program.use();
+    program.setInt(program.uniform("uAlbedo"), GBUFFER_TEXTURE_UNIT);
+    program.setInt(program.uniform("uNormal"), GBUFFER_TEXTURE_UNIT + 1);
+    program.setInt(program.uniform("uDepth"), GBUFFER_TEXTURE_UNIT + 2);
+    program.setInt(program.uniform("uLightData"), LIGHT_TEXTURE_UNIT);
+    program.setInt(program.uniform("uClusterGrid"), LIGHT_TEXTURE_UNIT + 1);
+    program.setInt(program.uniform("uLightIndices"), LIGHT_TEXTURE_UNIT + 2);
+    inverseViewProjectionSlot = program.uniform("uInverseViewProjection");
+    viewportSizeSlot = program.uniform("uViewportSize");
+
+    if (!resizeGBuffer(framebufferWidth, framebufferHeight)) {
+        std::cerr << "G-buffer incomplete; falling back to forward shading" << std::endl;
+        deferredShadingEnabled = false;
+    }
+}
+
+void submitRenderCommand(RenderPass pass, unsigned int program, const std::shared_ptr<MeshBatch>& batch,
+                         const glm::mat4& model, glm::vec4 colour) {
+    if (batch->getIndexCount() == 0) return;
+
+    float distance = glm::length(glm::vec3(model[3]) - cameraPos);
+    sortEntries.push_back({ makeSortKey(pass, program, batch->getId(), distance),
+                            static_cast<uint32_t>(renderCommands.size()) });
+    renderCommands.push_back({ pass, program, program == instancedShaderProgram, batch,
+                               InstanceData::make(model, colour) });
+}
+
+namespace {
+    //dynamic resolution's GPU timer, started by the first flush of a frame
+    void startSceneTimer();
+}
+
+void flushRenderQueue() {
+    startSceneTimer();
+
+    //immediate-mode shapes are opaque; they go out first, merged into as few draws as possible
+    if (!pendingTransientVertices.empty()) {
+        applyPassState(RenderPass::Opaque);
+        drawPendingTransients();
+    }
+
+    radixSort(sortEntries, sortScratch);
+
+    std::vector<InstanceData> instanceData;
+    bool deferred = deferredShadingEnabled && drawDeferredOpaque(instanceData);
+    bool depthPrepassed = !deferred && depthPrepassEnabled && drawDepthPrepass(instanceData);
+    bool passSet = false;
+    RenderPass currentPass = RenderPass::Opaque;
+    unsigned int currentProgram = 0;
+    MeshBatch* currentBatch = nullptr;
+
+    for (size_t i = 0; i < sortEntries.size();) {
+        RenderCommand& command = renderCommands[sortEntries[i].index];
+        if (deferred && isDeferred(command)) {
+            i++;
+            continue;
+        }
+
+        if (!passSet || command.pass != currentPass) {
+            if (command.pass != RenderPass::Opaque && skyPending) {
+                drawSky();
+                currentProgram = 0;
+                currentBatch = nullptr;
+            }
+            applyPassState(command.pass, depthPrepassed);
+            currentPass = command.pass;
+            passSet = true;
+        }
+
+        ShaderProgram& program = getShaderProgram(command.program);
+        if (command.program != currentProgram) {
+            program.use();
+            currentProgram = command.program;
+        }
+        if (command.batch.get() != currentBatch) {
+            command.batch->bind();
+            currentBatch = command.batch.get();
+        }
+        currentBatch->setDecodeUniforms(program);
+
+        if (!command.instanced) {
+            program.setVec4(program.colorUniform, command.instance.colour);
+            program.setMat4(program.modelUniform, command.instance.model);
+            program.setMat3(program.normalMatrixUniform, command.instance.normalMatrix);
+            currentBatch->draw();
+            i++;
+            continue;
+        }
+
+        //merge the run of commands sharing pass, program and mesh into one instanced draw
+        instanceData.clear();
+        size_t end = i;
+        for (; end < sortEntries.size(); end++) {
+            const RenderCommand& next = renderCommands[sortEntries[end].index];
+            if (next.pass != command.pass || next.program != command.program || next.batch != command.batch) break;
+            instanceData.push_back(next.instance);
+        }
+        currentBatch->drawInstanced(instanceData.data(), static_cast<int>(end - i));
+        i = end;
+    }
+
+    //a frame with nothing past the opaque pass still gets its sky
+    drawSky();
+
+    //leave the default state for anything drawn after the queue
+    applyPassState(RenderPass::Opaque);
+
+    renderCommands.clear();
+    sortEntries.clear();
+}
+
+//Physicals
+bool Physical::isMeshCompiled() const {
+    bool unchanged = batch && batch->getFormat() == vertexFormat && compiledShapes.size() == mesh.size();
+    for (size_t i = 0; unchanged && i < mesh.size(); i++) {
+        unchanged = compiledShapes[i] == mesh[i].get();
+    }
+    return unchanged;
+}
+
+void Physical::compileMesh() {
+    if (isMeshCompiled()) return;
+
+    //batches may be shared with other Physicals, so a changed mesh is registered afresh
+    if (batch) computeBounds();
+    batch = registerMesh(mesh, vertexFormat);
+
+    compiledShapes.clear();
+    for (const auto& shape : mesh) compiledShapes.push_back(shape.get());
+}
+
+glm::mat4 Physical::getModelMatrix() const {
+    glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(x, y, z));
+    model = glm::rotate(model, rotation.y, glm::vec3(0.0f, 1.0f, 0.0f));
+    model = glm::rotate(model, rotation.x, glm::vec3(1.0f, 0.0f, 0.0f));
+    model = glm::rotate(model, rotation.z, glm::vec3(0.0f, 0.0f, 1.0f));
+    return glm::scale(model, scale);
+}
+
+void Physical::getWorldBounds(glm::vec3& minOut, glm::vec3& maxOut) const {
+    //transform the box centre, and grow the half extents by the absolute basis vectors
+    glm::mat4 model = getModelMatrix();
+    glm::vec3 centre = glm::vec3(model * glm::vec4((localMin + localMax) * 0.5f, 1.0f));
+    glm::vec3 halfExtent = (localMax - localMin) * 0.5f;
+    glm::vec3 worldExtent = glm::abs(glm::vec3(model[0])) * halfExtent.x
+                          + glm::abs(glm::vec3(model[1])) * halfExtent.y
+                          + glm::abs(glm::vec3(model[2])) * halfExtent.z;
+    minOut = centre - worldExtent;
+    maxOut = centre + worldExtent;
+}
+
+void Physical::draw(unsigned int currentShaderProgram) {
+    compileMesh();
+    if (batch->getIndexCount() == 0) return;
+
+    ShaderProgram& program = getShaderProgram(currentShaderProgram);
+    program.use();
+    program.setVec4(program.colorUniform, colour);
+    glm::mat4 model = getModelMatrix();
+    program.setMat4(program.modelUniform, model);
+    program.setMat3(program.normalMatrixUniform, glm::transpose(glm::inverse(glm::mat3(model))));
+
+    batch->bind();
+    batch->setDecodeUniforms(program);
+    batch->draw();
+}
+
+unsigned int createInstancedShaderProgram() {
+    return submitProgram(instancedVertexShaderSource, instancedFragmentShaderSource);
+}
+
+unsigned int createDepthShaderProgram() {
+    return submitProgram(depthVertexShaderSource, depthFragmentShaderSource);
+}
+
+void renderPauseMenu(unsigned int pauseShaderProgram) {
+    // Simple translucent rectangle in front of everything
+    glm::vec4 pauseOverlayColor(0.0f, 0.0f, 0.0f, 0.5f); // translucent black
+
+    // Draw a 2D quad in NDC [-1, 1] space over screen
+    static auto overlayBatch = std::make_shared<MeshBatch>(std::vector<float>{
+            -0.5f,  0.3f, 0.0f, 0.0f, 1.0f, 0.0f,
+            -0.5f, -0.3f, 0.0f, 0.0f, 1.0f, 0.0f,
+            0.5f, -0.3f, 0.0f, 0.0f, 1.0f, 0.0f,
+
+            -0.5f,  0.3f, 0.0f, 0.0f, 1.0f, 0.0f,
+            0.5f, -0.3f, 0.0f, 0.0f, 1.0f, 0.0f,
+            0.5f,  0.3f, 0.0f, 0.0f, 1.0f, 0.0f,
+    });
+
+    // Pause screen should overlay everything, so it goes in the blended no-depth pass
+    submitRenderCommand(RenderPass::Overlay, pauseShaderProgram, overlayBatch, glm::mat4(1.0f), pauseOverlayColor);
 }
 
 //engine startup
@@ -211,6 +2086,7 @@ void startEngine(){
 
     //allow resize
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
 
     //glad init
     if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress)) {
@@ -218,8 +2094,41 @@ void startEngine(){
         gameActive = false;
     }
 
-    glDisable(GL_CULL_FACE);
+    glState.disable(GL_CULL_FACE);
+
+    //frame globals block, refilled every frame and shared by all programs at one binding
+    glGenBuffers(1, &frameGlobalsUBO);
+    glState.bindBuffer(GL_UNIFORM_BUFFER, frameGlobalsUBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameGlobals), nullptr, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_GLOBALS_BINDING, frameGlobalsUBO);
+
+    transientRing.init();
+
+    //every program goes to the driver before any status is read, then gets checked once;
+    //ShaderProgram enumerates uniforms, so the wrappers are made after that
     shaderProgram = createShaderProgram();
+    instancedShaderProgram = createInstancedShaderProgram();
+    backgroundShaderProgram = createBackgroundShaderProgram();
+    uiShaderProgram = createUIShaderProgram();
+    depthShaderProgram = createDepthShaderProgram();
+    shadowShaderProgram = submitProgram(shadowVertexShaderSource, depthFragmentShaderSource);
+    if (skyboxEnabled) skyboxShaderProgram = submitProgram(skyboxVertexShader, skyboxFragmentShader);
+    if (deferredShadingEnabled) {
+        //the G-buffer pass shares the instanced vertex stage, so depths match the forward path
+        gBufferShaderProgram = submitProgram(instancedVertexShaderSource, gBufferFragmentShaderSource);
+        deferredLightingShaderProgram = submitProgram(uiVertexShaderSource, deferredLightingFragmentShaderSource);
+    }
+    finishPrograms();
+
+    getShaderProgram(shaderProgram);
+    getShaderProgram(instancedShaderProgram);
+    getShaderProgram(backgroundShaderProgram);
+    getShaderProgram(uiShaderProgram);
+    getShaderProgram(depthShaderProgram);
+    getShaderProgram(shadowShaderProgram);
+    initLighting();
+    if (deferredShadingEnabled) initDeferredShading();
+    initShadows();
 
     //background setup
     float backgroundVertices[] = {
@@ -232,20 +2141,18 @@ void startEngine(){
             1.0f,  1.0f, 0.0f
     };
 
-    backgroundShaderProgram = createBackgroundShaderProgram();
-
     glGenVertexArrays(1, &backgroundVAO);
     glGenBuffers(1, &backgroundVBO);
-    glBindVertexArray(backgroundVAO);
+    glState.bindVertexArray(backgroundVAO);
 
-    glBindBuffer(GL_ARRAY_BUFFER, backgroundVBO);
+    glState.bindBuffer(GL_ARRAY_BUFFER, backgroundVBO);
     glBufferData(GL_ARRAY_BUFFER, sizeof(backgroundVertices), backgroundVertices, GL_STATIC_DRAW);
 
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
     glEnableVertexAttribArray(0);
 
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindVertexArray(0);
+    glState.bindBuffer(GL_ARRAY_BUFFER, 0);
+    glState.bindVertexArray(0);
 
     const float crossSize = 0.025f; // previously 0.05f
     const float lineWidth = 0.0025f; // previously 0.005f
@@ -273,16 +2180,14 @@ void startEngine(){
 
     glGenVertexArrays(1, &crosshairVAO);
     glGenBuffers(1, &crosshairVBO);
-    glBindVertexArray(crosshairVAO);
+    glState.bindVertexArray(crosshairVAO);
 
-    glBindBuffer(GL_ARRAY_BUFFER, crosshairVBO);
+    glState.bindBuffer(GL_ARRAY_BUFFER, crosshairVBO);
     glBufferData(GL_ARRAY_BUFFER, sizeof(crosshairVertices), crosshairVertices, GL_STATIC_DRAW);
 
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
     glEnableVertexAttribArray(0);
-    glBindVertexArray(0);
-
-    uiShaderProgram = createUIShaderProgram();
+    glState.bindVertexArray(0);
 
     if (skyboxEnabled){
         const char* skyboxFaces[6] = {"/Users/adrianlloyd/Desktop/Work/Projects/BoltsEngine/EngineTemplate/skybox/right.png",
@@ -293,117 +2198,324 @@ void startEngine(){
                                       "/Users/adrianlloyd/Desktop/Work/Projects/BoltsEngine/EngineTemplate/skybox/back.png"};
         initSkybox(skyboxFaces);
     }
+
+    logProgramStats();
 }
 
 //core engine mechanics
+bool pipelinedSimulationEnabled = false;
+
+namespace {
+    //simulation of the next frame, running while the current one is submitted
+    std::future<void> pendingSimulation;
+    bool simulatedAhead = false;
+}
+
+void waitForSimulation() {
+    if (pendingSimulation.valid()) pendingSimulation.get();
+}
+
 void engineUpdate() {
+    waitForSimulation();
+
     float currentTime = static_cast<float>(glfwGetTime());
     deltaTime = currentTime - lastFrameTime;
     lastFrameTime = currentTime;
 
-    if (glfwWindowShouldClose(window)) {
-        gameActive = false;
-        return;
+    if (glfwWindowShouldClose(window)) {
+        gameActive = false;
+        return;
+    }
+
+//    physicalWorld.clear();
+//    surfaces.clear();
+
+    keyboardInput(window);
+    glfwPollEvents();
+}
+
+//Dynamic resolution
+bool dynamicResolutionEnabled = false;
+float targetFrameMilliseconds = 16.6f;
+float minResolutionScale = 0.5f;
+float maxResolutionScale = 1.0f;
+float resolutionScale = 1.0f;
+int renderWidth = static_cast<int>(WINDOW_WIDTH), renderHeight = static_cast<int>(WINDOW_HEIGHT);
+unsigned int sceneFramebuffer = 0;
+
+namespace {
+    //Offscreen colour and depth at the full framebuffer size; lower scales use its corner
+    unsigned int offscreenFramebuffer = 0, offscreenColour = 0, offscreenDepth = 0;
+    int offscreenWidth = 0, offscreenHeight = 0;
+    bool sceneResolved = true;
+
+    //Timer queries in a ring, so each result is read a few frames after it was issued
+    const int TIMER_QUERIES = 4;
+    unsigned int timerQueries[TIMER_QUERIES];
+    bool timerIssued[TIMER_QUERIES] = {};
+    int timerIndex = 0;
+    bool timerWanted = false;
+    bool timerRunning = false;
+    float gpuSceneMilliseconds = 0.0f;
+    float cpuFrameMilliseconds = 0.0f;
+
+    void resizeOffscreen(int width, int height) {
+        if (offscreenFramebuffer == 0) {
+            glGenFramebuffers(1, &offscreenFramebuffer);
+            glGenTextures(1, &offscreenColour);
+            glGenRenderbuffers(1, &offscreenDepth);
+            glGenQueries(TIMER_QUERIES, timerQueries);
+        }
+        offscreenWidth = width;
+        offscreenHeight = height;
+
+        glState.activeTexture(GL_TEXTURE0);
+        glState.bindTexture(GL_TEXTURE_2D, offscreenColour);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glBindRenderbuffer(GL_RENDERBUFFER, offscreenDepth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+        glState.bindFramebuffer(offscreenFramebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, offscreenColour, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, offscreenDepth);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            std::cerr << "Offscreen framebuffer incomplete; dynamic resolution disabled" << std::endl;
+            dynamicResolutionEnabled = false;
+        }
+        glState.bindFramebuffer(0);
+    }
+
+    //Picks up finished timer queries, then steps the scale. GPU time is taken to grow with
+    //the pixel count, so the scale follows the square root of the budget ratio, aiming at 90%
+    //of the target with a dead band and at most 5% change per frame to avoid oscillating
+    void updateResolutionScale() {
+        for (int i = 0; i < TIMER_QUERIES; i++) {
+            if (!timerIssued[i] || i == timerIndex) continue;
+            int available = 0;
+            glGetQueryObjectiv(timerQueries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) continue;
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v(timerQueries[i], GL_QUERY_RESULT, &nanoseconds);
+            gpuSceneMilliseconds = static_cast<float>(nanoseconds) / 1.0e6f;
+            timerIssued[i] = false;
+        }
+        cpuFrameMilliseconds = glm::mix(cpuFrameMilliseconds, getDeltaTime() * 1000.0f, 0.1f);
+
+        float maxScale = glm::clamp(maxResolutionScale, minResolutionScale, 1.0f);
+        if (gpuSceneMilliseconds > 0.0f) {
+            float aim = targetFrameMilliseconds * 0.9f;
+            float wanted = resolutionScale * std::sqrt(aim / gpuSceneMilliseconds);
+            bool overBudget = gpuSceneMilliseconds > targetFrameMilliseconds * 0.95f;
+            bool roomToGrow = gpuSceneMilliseconds < targetFrameMilliseconds * 0.8f &&
+                              cpuFrameMilliseconds < targetFrameMilliseconds * 1.1f;
+            if (overBudget || roomToGrow) {
+                resolutionScale = glm::clamp(wanted, resolutionScale * 0.95f, resolutionScale * 1.05f);
+            }
+        }
+        resolutionScale = glm::clamp(resolutionScale, minResolutionScale, maxScale);
+    }
+
+    //Froxels per pixel of the current render size (the xy of FrameGlobals::clusterScale)
+    glm::vec2 clusterTileScale() {
+        return { CLUSTER_TILES_X / static_cast<float>(std::max(renderWidth, 1)),
+                 CLUSTER_TILES_Y / static_cast<float>(std::max(renderHeight, 1)) };
+    }
+
+    //Chooses this frame's render target and size, and asks for the scene to be timed
+    void beginSceneTarget() {
+        sceneResolved = false;
+        if (!dynamicResolutionEnabled || framebufferWidth <= 0 || framebufferHeight <= 0) {
+            sceneFramebuffer = 0;
+            renderWidth = framebufferWidth;
+            renderHeight = framebufferHeight;
+            resolutionScale = 1.0f;
+            return;
+        }
+
+        if (offscreenWidth != framebufferWidth || offscreenHeight != framebufferHeight) {
+            resizeOffscreen(framebufferWidth, framebufferHeight);
+            if (!dynamicResolutionEnabled) {
+                beginSceneTarget();
+                return;
+            }
+        }
+        updateResolutionScale();
+
+        sceneFramebuffer = offscreenFramebuffer;
+        renderWidth = std::max(1, static_cast<int>(framebufferWidth * resolutionScale + 0.5f));
+        renderHeight = std::max(1, static_cast<int>(framebufferHeight * resolutionScale + 0.5f));
+
+        timerWanted = true;
     }
 
-//    physicalWorld.clear();
-//    surfaces.clear();
+    //Timing starts with the first flush rather than in engineBeginFrame, so the CPU work in
+    //between (drawScene, game logic) does not count as GPU time
+    void startSceneTimer() {
+        if (!timerWanted) return;
+        timerWanted = false;
+        glBeginQuery(GL_TIME_ELAPSED, timerQueries[timerIndex]);
+        timerRunning = true;
+    }
+}
 
-    keyboardInput(window);
-    glfwPollEvents();
+void resolveScene() {
+    if (sceneResolved) return;
+    sceneResolved = true;
+    timerWanted = false;
+
+    if (timerRunning) {
+        glEndQuery(GL_TIME_ELAPSED);
+        timerIssued[timerIndex] = true;
+        timerIndex = (timerIndex + 1) % TIMER_QUERIES;
+        timerRunning = false;
+    }
+    if (sceneFramebuffer == 0) return;
+
+    glState.bindFramebuffer(0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, sceneFramebuffer);
+    glBlitFramebuffer(0, 0, renderWidth, renderHeight, 0, 0, framebufferWidth, framebufferHeight,
+                      GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    glViewport(0, 0, framebufferWidth, framebufferHeight);
+
+    //the window's depth is still last frame's; anything drawn after the UI tests against it
+    glState.depthMask(true);
+    glClear(GL_DEPTH_BUFFER_BIT);
+
+    //the rest of the frame (UI, commands queued after it) draws straight to the window at
+    //native size, so the froxel lookup in the globals follows the new render size
+    sceneFramebuffer = 0;
+    renderWidth = framebufferWidth;
+    renderHeight = framebufferHeight;
+    glm::vec2 tileScale = clusterTileScale();
+    glState.bindBuffer(GL_UNIFORM_BUFFER, frameGlobalsUBO);
+    glBufferSubData(GL_UNIFORM_BUFFER, offsetof(FrameGlobals, clusterScale), sizeof(tileScale), &tileScale);
 }
 
 //rendering
 void engineBeginFrame(){
-    simulateFrame();
-
-    const glm::vec4 bg(0, 0, 0.431, 1);
-    glClearColor(bg.r, bg.g, bg.b, bg.a);
-    glEnable(GL_DEPTH_TEST);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    lastFrameStats = frameStats;
+    frameStats = FrameStats();
 
-    if (skyboxEnabled) renderSkybox();
-    else{
-        glDepthMask(GL_FALSE);
-        glUseProgram(backgroundShaderProgram);
-        glBindVertexArray(backgroundVAO);
-        glDrawArrays(GL_TRIANGLES, 0, 6);
-        glDepthMask(GL_TRUE);
-    }
+    //a pipelined frame was already simulated during the previous one
+    if (!simulatedAhead) simulateFrame();
+    simulatedAhead = false;
 
-    glUseProgram(shaderProgram);
+    beginSceneTarget();
+    frameStats.resolutionScale = resolutionScale;
+    frameStats.gpuSceneMilliseconds = gpuSceneMilliseconds;
 
-    glm::mat4 projection = glm::perspective(
-            glm::radians(45.0f),
+    FrameGlobals globals{};
+    globals.projection = glm::perspective(
+            glm::radians(CAMERA_FOV),
             (float)WINDOW_WIDTH / (float)WINDOW_HEIGHT,
-            0.1f,
-            2000.0f
+            CAMERA_NEAR,
+            CAMERA_FAR
     );
-
-    glm::mat4 view = glm::lookAt(
+    globals.view = glm::lookAt(
             cameraPos,
             cameraPos + cameraFront,
             cameraUp
     );
+    globals.viewProjection = globals.projection * globals.view;
+    viewFrustum = Frustum::fromMatrix(globals.viewProjection);
+    if (occlusionCullingEnabled) buildOcclusionBuffer(globals.viewProjection);
+    globals.cameraPosition = glm::vec4(cameraPos, 1.0f);
+    globals.lightPosition = glm::vec4(sceneLightPos, 1.0f);
+    float sliceScale = CLUSTER_SLICES / std::log(CAMERA_FAR / CAMERA_NEAR);
+    globals.clusterScale = glm::vec4(clusterTileScale(), sliceScale, -std::log(CAMERA_NEAR) * sliceScale);
+    updateLightClusters(globals.view);
+    if (deferredShadingEnabled) deferredInverseViewProjection = glm::inverse(globals.viewProjection);
+    updateShadowMaps(globals);
+
+    glState.bindFramebuffer(sceneFramebuffer);
+    glViewport(0, 0, renderWidth, renderHeight);
+
+    glState.bindBuffer(GL_UNIFORM_BUFFER, frameGlobalsUBO);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameGlobals), &globals);
 
-    glUniformMatrix4fv(
-            glGetUniformLocation(shaderProgram, "view"),
-            1, GL_FALSE, &view[0][0]
-    );
-    glUniformMatrix4fv(
-            glGetUniformLocation(shaderProgram, "projection"),
-            1, GL_FALSE, &projection[0][0]
-    );
+    const glm::vec4 bg(0, 0, 0.431, 1);
+    glClearColor(bg.r, bg.g, bg.b, bg.a);
+    glState.enable(GL_DEPTH_TEST);
+    glState.depthMask(true); // glClear honours the depth mask
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+    //drawn by flushRenderQueue after the opaque pass, so early-z skips covered pixels
+    skyPending = true;
+
+    getShaderProgram(shaderProgram).use();
 }
 void engineEndFrame(){
+    //game code is done with physicalWorld and the queue holds copies of everything it drew,
+    //so the next frame can be simulated while this one is flushed and swapped
+    if (pipelinedSimulationEnabled) {
+        pendingSimulation = std::async(std::launch::async, simulateFrame);
+        simulatedAhead = true;
+    }
+
+    //catches the scene when a game skips handleUI; anything queued after handleUI goes to
+    //the window at native size, since resolveScene re-targeted the frame there
+    flushRenderQueue();
+    resolveScene();
+    transientRing.endFrame();
     glfwSwapBuffers(window);
 }
 
 //UI handler
 void handleUI(){
-    glUseProgram(uiShaderProgram);
-    glBindVertexArray(crosshairVAO);
-    glDisable(GL_DEPTH_TEST);
+    //the queued scene goes out before the UI is drawn over it, at native resolution
+    flushRenderQueue();
+    resolveScene();
+
+    ShaderProgram& program = getShaderProgram(uiShaderProgram);
+    program.use();
+    glState.bindVertexArray(crosshairVAO);
+    glState.disable(GL_DEPTH_TEST);
 
-    int colorLoc = glGetUniformLocation(uiShaderProgram, "uColor");
-    glUniform4f(colorLoc, 1, 1, 1, 1);
+    program.setVec4(program.colorUniform, glm::vec4(1, 1, 1, 1));
 
     glDrawArrays(GL_TRIANGLES, 0, 12);
-    glEnable(GL_DEPTH_TEST);
+    glState.enable(GL_DEPTH_TEST);
 }
 
 
 bool isPaused = false;
 const char* vertexShaderSource = R"(
-#version 330 core
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aNormal;
 
 out vec3 FragPos;
 out vec3 Normal;
 
-uniform mat4 projection;
-uniform mat4 view;
+uniform mat4 uModel;        // object to world
+uniform mat3 uNormalMatrix; // inverse transpose of uModel's upper 3x3
+uniform vec3 uPositionOrigin; // compact meshes: aPos is normalised to this box
+uniform vec3 uPositionExtent;
+
+invariant gl_Position; // must match the depth pre-pass
 
 void main() {
-    FragPos = aPos;
-    Normal = aNormal;
-    gl_Position = projection * view * vec4(aPos, 1.0);
+    vec3 position = uPositionOrigin + aPos * uPositionExtent;
+    vec4 worldPos = uModel * vec4(position, 1.0);
+    FragPos = worldPos.xyz;
+    Normal = uNormalMatrix * aNormal;
+    gl_Position = viewProjection * worldPos;
 }
 )";
 const char* fragmentShaderSource = R"(
-#version 330 core
 out vec4 FragColor;
 
 in vec3 FragPos;
 in vec3 Normal;
 
 uniform vec4 uColor;
-uniform vec3 lightPos;
-uniform vec3 viewPos; // camera position
 
 void main() {
+    vec3 lightPos = lightPosition.xyz;
+    vec3 viewPos = cameraPosition.xyz;
+
     // Ambient
     vec3 ambient = 0.2 * uColor.rgb;
 
@@ -419,8 +2531,147 @@ void main() {
     float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32);
     vec3 specular = spec * vec3(1.0);
 
-    vec3 result = ambient + diffuse + specular;
+    vec3 result = ambient + (diffuse + specular) * sceneShadow(FragPos, norm) + pointLighting(FragPos, norm, viewDir, uColor.rgb);
+    FragColor = vec4(result, uColor.a);
+}
+)";
+const char* instancedVertexShaderSource = R"(
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+layout (location = 2) in vec4 aColor;        // per instance
+layout (location = 3) in mat4 aModel;        // per instance, locations 3-6
+layout (location = 7) in mat3 aNormalMatrix; // per instance, locations 7-9
+
+out vec3 FragPos;
+out vec3 Normal;
+out vec4 Color;
+
+uniform vec3 uPositionOrigin; // compact meshes: aPos is normalised to this box
+uniform vec3 uPositionExtent;
+
+invariant gl_Position; // must match the depth pre-pass
+
+void main() {
+    vec3 position = uPositionOrigin + aPos * uPositionExtent;
+    vec4 worldPos = aModel * vec4(position, 1.0);
+    FragPos = worldPos.xyz;
+    Normal = aNormalMatrix * aNormal;
+    Color = aColor;
+    gl_Position = viewProjection * worldPos;
+}
+)";
+const char* instancedFragmentShaderSource = R"(
+out vec4 FragColor;
+
+in vec3 FragPos;
+in vec3 Normal;
+in vec4 Color;
+
+void main() {
+    vec3 lightPos = lightPosition.xyz;
+    vec3 viewPos = cameraPosition.xyz;
+
+    vec3 ambient = 0.2 * Color.rgb;
+
+    vec3 norm = normalize(Normal);
+    vec3 lightDir = normalize(lightPos - FragPos);
+    float diff = max(dot(norm, lightDir), 0.0);
+    vec3 diffuse = diff * Color.rgb;
+
+    vec3 viewDir = normalize(viewPos - FragPos);
+    vec3 reflectDir = reflect(-lightDir, norm);
+    float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32);
+    vec3 specular = spec * vec3(1.0);
+
+    vec3 result = ambient + (diffuse + specular) * sceneShadow(FragPos, norm) + pointLighting(FragPos, norm, viewDir, Color.rgb);
+    FragColor = vec4(result, Color.a);
+}
+)";
+const char* depthVertexShaderSource = R"(
+layout (location = 0) in vec3 aPos;
+layout (location = 3) in mat4 aModel; // per instance, locations 3-6
+
+uniform vec3 uPositionOrigin;
+uniform vec3 uPositionExtent;
+
+// same expression as the lit shaders, so GL_LEQUAL matches exactly
+invariant gl_Position;
+
+void main() {
+    vec3 position = uPositionOrigin + aPos * uPositionExtent;
+    vec4 worldPos = aModel * vec4(position, 1.0);
+    gl_Position = viewProjection * worldPos;
+}
+)";
+const char* depthFragmentShaderSource = R"(
+#version 330 core
+
+void main() {
+}
+)";
+const char* shadowVertexShaderSource = R"(
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 3) in mat4 aModel; // per instance, locations 3-6
+
+uniform mat4 uLightViewProjection;
+uniform vec3 uPositionOrigin;
+uniform vec3 uPositionExtent;
+
+void main() {
+    vec3 position = uPositionOrigin + aPos * uPositionExtent;
+    gl_Position = uLightViewProjection * (aModel * vec4(position, 1.0));
+}
+)";
+const char* gBufferFragmentShaderSource = R"(
+#version 330 core
+layout (location = 0) out vec4 Albedo;
+layout (location = 1) out vec4 NormalOut;
+
+in vec3 FragPos;
+in vec3 Normal;
+in vec4 Color;
+
+void main() {
+    Albedo = vec4(Color.rgb, 1.0);
+    NormalOut = vec4(normalize(Normal) * 0.5 + 0.5, 1.0);
+}
+)";
+const char* deferredLightingFragmentShaderSource = R"(
+out vec4 FragColor;
+
+uniform sampler2D uAlbedo;
+uniform sampler2D uNormal;
+uniform sampler2D uDepth;
+uniform mat4 uInverseViewProjection;
+uniform vec2 uViewportSize; // the G-buffer is only filled up to this, under dynamic resolution
+
+void main() {
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(uDepth, texel, 0).r;
+    if (depth == 1.0) discard; // nothing drawn here; the sky pass fills it
+
+    vec2 ndc = gl_FragCoord.xy / uViewportSize * 2.0 - 1.0;
+    vec4 world = uInverseViewProjection * vec4(ndc, depth * 2.0 - 1.0, 1.0);
+    vec3 FragPos = world.xyz / world.w;
+
+    vec3 albedo = texelFetch(uAlbedo, texel, 0).rgb;
+    vec3 norm = normalize(texelFetch(uNormal, texel, 0).xyz * 2.0 - 1.0);
+    vec3 viewDir = normalize(cameraPosition.xyz - FragPos);
+
+    vec3 ambient = 0.2 * albedo;
+
+    vec3 lightDir = normalize(lightPosition.xyz - FragPos);
+    float diff = max(dot(norm, lightDir), 0.0);
+    vec3 diffuse = diff * albedo;
+
+    vec3 reflectDir = reflect(-lightDir, norm);
+    float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32);
+    vec3 specular = spec * vec3(1.0);
+
+    vec3 result = ambient + (diffuse + specular) * sceneShadow(FragPos, norm) + pointLighting(FragPos, norm, viewDir, albedo);
     FragColor = vec4(result, 1.0);
+    gl_FragDepth = depth;
 }
 )";
 const char* backgroundVertexShader = R"(
@@ -430,7 +2681,7 @@ out vec2 uv;
 
 void main() {
     uv = aPos.xy * 0.5 + 0.5; // convert from [-1,1] to [0,1]
-    gl_Position = vec4(aPos, 1.0);
+    gl_Position = vec4(aPos.xy, 1.0, 1.0); // on the far plane, drawn behind everything
 }
 )";
 const char* backgroundFragmentShader = R"(
@@ -473,21 +2724,17 @@ float sensitivity = 0.1f;
 
 //Skyboxes
 
-// Add these to bolts.h
 unsigned int skyboxVAO, skyboxVBO;
-unsigned int skyboxShaderProgram;
+unsigned int skyboxShaderProgram = 0;
 unsigned int cubemapTexture;
+int skyboxSamplerSlot = -1;
 
 // Skybox shader sources
 const char* skyboxVertexShader = R"(
-#version 330 core
 layout (location = 0) in vec3 aPos;
 
 out vec3 TexCoords;
 
-uniform mat4 projection;
-uniform mat4 view;
-
 void main() {
     TexCoords = aPos;
     vec4 pos = projection * mat4(mat3(view)) * vec4(aPos, 1.0);
@@ -509,21 +2756,10 @@ void main() {
 )";
 
 unsigned int initSkybox(const char* faces[6]) {
-    unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertexShader, 1, &skyboxVertexShader, nullptr);
-    glCompileShader(vertexShader);
+    //startEngine submits it with the other programs; built here when called on its own
+    if (skyboxShaderProgram == 0) skyboxShaderProgram = buildProgram(skyboxVertexShader, skyboxFragmentShader);
 
-    unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader, 1, &skyboxFragmentShader, nullptr);
-    glCompileShader(fragmentShader);
-
-    skyboxShaderProgram = glCreateProgram();
-    glAttachShader(skyboxShaderProgram, vertexShader);
-    glAttachShader(skyboxShaderProgram, fragmentShader);
-    glLinkProgram(skyboxShaderProgram);
-
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
+    skyboxSamplerSlot = getShaderProgram(skyboxShaderProgram).uniform("skybox");
 
     float skyboxVertices[] = {
             -1.0f,  1.0f, -1.0f,
@@ -571,14 +2807,14 @@ unsigned int initSkybox(const char* faces[6]) {
 
     glGenVertexArrays(1, &skyboxVAO);
     glGenBuffers(1, &skyboxVBO);
-    glBindVertexArray(skyboxVAO);
-    glBindBuffer(GL_ARRAY_BUFFER, skyboxVBO);
+    glState.bindVertexArray(skyboxVAO);
+    glState.bindBuffer(GL_ARRAY_BUFFER, skyboxVBO);
     glBufferData(GL_ARRAY_BUFFER, sizeof(skyboxVertices), &skyboxVertices, GL_STATIC_DRAW);
     glEnableVertexAttribArray(0);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
 
     glGenTextures(1, &cubemapTexture);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture);
+    glState.bindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture);
 
     int successCount = 0;
     for (unsigned int i = 0; i < 6; i++) {
@@ -619,48 +2855,913 @@ unsigned int initSkybox(const char* faces[6]) {
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
 
-    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    glState.bindTexture(GL_TEXTURE_CUBE_MAP, 0);
 
     return cubemapTexture;
 }
 
 void renderSkybox() {
-    glDepthFunc(GL_LEQUAL);
-    glUseProgram(skyboxShaderProgram);
+    glState.depthFunc(GL_LEQUAL);
+    ShaderProgram& program = getShaderProgram(skyboxShaderProgram);
+    program.use();
+    program.setInt(skyboxSamplerSlot, 0);
+
+    //view/projection come from the frame globals; the shader strips the translation itself
+    glState.bindVertexArray(skyboxVAO);
+    glState.activeTexture(GL_TEXTURE0);
+    glState.bindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture);
+
+    glDrawArrays(GL_TRIANGLES, 0, 36);
+    glState.bindVertexArray(0);
+    glState.depthFunc(GL_LESS);
+}
+
+void renderBackground() {
+    glState.depthFunc(GL_LEQUAL);
+    glState.depthMask(false);
+    getShaderProgram(backgroundShaderProgram).use();
+    glState.bindVertexArray(backgroundVAO);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+    glState.depthMask(true);
+    glState.depthFunc(GL_LESS);
+}
+
+//Culling
+
+Frustum Frustum::fromMatrix(const glm::mat4& viewProjection) {
+    //rows of the (column-major) matrix; each plane is row 3 plus or minus another row
+    glm::vec4 rows[4];
+    for (int i = 0; i < 4; i++) {
+        rows[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+    }
+
+    Frustum frustum{};
+    frustum.planes[0] = rows[3] + rows[0]; // left
+    frustum.planes[1] = rows[3] - rows[0]; // right
+    frustum.planes[2] = rows[3] + rows[1]; // bottom
+    frustum.planes[3] = rows[3] - rows[1]; // top
+    frustum.planes[4] = rows[3] + rows[2]; // near
+    frustum.planes[5] = rows[3] - rows[2]; // far
+    return frustum;
+}
+
+bool Frustum::intersects(const glm::vec3& minBounds, const glm::vec3& maxBounds) const {
+    glm::vec3 centre = (minBounds + maxBounds) * 0.5f;
+    glm::vec3 halfExtent = (maxBounds - minBounds) * 0.5f;
+    for (const glm::vec4& plane : planes) {
+        glm::vec3 normal(plane);
+        float distance = glm::dot(normal, centre) + plane.w;
+        float radius = glm::dot(halfExtent, glm::abs(normal));
+        if (distance < -radius) return false;
+    }
+    return true;
+}
+
+//Occlusion culling
+
+namespace {
+    //Four-wide float operations on SSE2, NEON or plain arrays
+    namespace simd {
+#if defined(BOLTS_SIMD_SSE2)
+        using Float4 = __m128;
+        using Mask4 = __m128;
+        inline Float4 load(const float* p) { return _mm_loadu_ps(p); }
+        inline void store(float* p, Float4 v) { _mm_storeu_ps(p, v); }
+        inline Float4 splat(float v) { return _mm_set1_ps(v); }
+        inline Float4 lanes(float a, float b, float c, float d) { return _mm_setr_ps(a, b, c, d); }
+        inline Float4 add(Float4 a, Float4 b) { return _mm_add_ps(a, b); }
+        inline Float4 sub(Float4 a, Float4 b) { return _mm_sub_ps(a, b); }
+        inline Float4 mul(Float4 a, Float4 b) { return _mm_mul_ps(a, b); }
+        inline Float4 max(Float4 a, Float4 b) { return _mm_max_ps(a, b); }
+        inline Mask4 greaterEqual(Float4 a, Float4 b) { return _mm_cmpge_ps(a, b); }
+        inline Mask4 less(Float4 a, Float4 b) { return _mm_cmplt_ps(a, b); }
+        inline Mask4 both(Mask4 a, Mask4 b) { return _mm_and_ps(a, b); }
+        inline Float4 select(Mask4 m, Float4 a, Float4 b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+        inline bool any(Mask4 m) { return _mm_movemask_ps(m) != 0; }
+        inline int laneMask(Mask4 m) { return _mm_movemask_ps(m); }
+#elif defined(BOLTS_SIMD_NEON)
+        using Float4 = float32x4_t;
+        using Mask4 = uint32x4_t;
+        inline Float4 load(const float* p) { return vld1q_f32(p); }
+        inline void store(float* p, Float4 v) { vst1q_f32(p, v); }
+        inline Float4 splat(float v) { return vdupq_n_f32(v); }
+        inline Float4 lanes(float a, float b, float c, float d) {
+            const float values[4] = { a, b, c, d };
+            return vld1q_f32(values);
+        }
+        inline Float4 add(Float4 a, Float4 b) { return vaddq_f32(a, b); }
+        inline Float4 sub(Float4 a, Float4 b) { return vsubq_f32(a, b); }
+        inline Float4 mul(Float4 a, Float4 b) { return vmulq_f32(a, b); }
+        inline Float4 max(Float4 a, Float4 b) { return vmaxq_f32(a, b); }
+        inline Mask4 greaterEqual(Float4 a, Float4 b) { return vcgeq_f32(a, b); }
+        inline Mask4 less(Float4 a, Float4 b) { return vcltq_f32(a, b); }
+        inline Mask4 both(Mask4 a, Mask4 b) { return vandq_u32(a, b); }
+        inline Float4 select(Mask4 m, Float4 a, Float4 b) { return vbslq_f32(m, a, b); }
+        inline bool any(Mask4 m) {
+            uint32x2_t halves = vorr_u32(vget_low_u32(m), vget_high_u32(m));
+            return (vget_lane_u32(halves, 0) | vget_lane_u32(halves, 1)) != 0;
+        }
+        inline int laneMask(Mask4 m) {
+            return static_cast<int>((vgetq_lane_u32(m, 0) & 1) | (vgetq_lane_u32(m, 1) & 2) |
+                                    (vgetq_lane_u32(m, 2) & 4) | (vgetq_lane_u32(m, 3) & 8));
+        }
+#else
+        struct Float4 { float v[4]; };
+        struct Mask4 { bool v[4]; };
+        inline Float4 load(const float* p) { return { { p[0], p[1], p[2], p[3] } }; }
+        inline void store(float* p, Float4 v) { for (int i = 0; i < 4; i++) p[i] = v.v[i]; }
+        inline Float4 splat(float v) { return { { v, v, v, v } }; }
+        inline Float4 lanes(float a, float b, float c, float d) { return { { a, b, c, d } }; }
+        inline Float4 add(Float4 a, Float4 b) { for (int i = 0; i < 4; i++) a.v[i] += b.v[i]; return a; }
+        inline Float4 sub(Float4 a, Float4 b) { for (int i = 0; i < 4; i++) a.v[i] -= b.v[i]; return a; }
+        inline Float4 mul(Float4 a, Float4 b) { for (int i = 0; i < 4; i++) a.v[i] *= b.v[i]; return a; }
+        inline Float4 max(Float4 a, Float4 b) { for (int i = 0; i < 4; i++) a.v[i] = std::max(a.v[i], b.v[i]); return a; }
+        inline Mask4 greaterEqual(Float4 a, Float4 b) {
+            Mask4 m{};
+            for (int i = 0; i < 4; i++) m.v[i] = a.v[i] >= b.v[i];
+            return m;
+        }
+        inline Mask4 less(Float4 a, Float4 b) {
+            Mask4 m{};
+            for (int i = 0; i < 4; i++) m.v[i] = a.v[i] < b.v[i];
+            return m;
+        }
+        inline Mask4 both(Mask4 a, Mask4 b) { for (int i = 0; i < 4; i++) a.v[i] = a.v[i] && b.v[i]; return a; }
+        inline Float4 select(Mask4 m, Float4 a, Float4 b) { for (int i = 0; i < 4; i++) if (!m.v[i]) a.v[i] = b.v[i]; return a; }
+        inline bool any(Mask4 m) { return m.v[0] || m.v[1] || m.v[2] || m.v[3]; }
+        inline int laneMask(Mask4 m) { return m.v[0] | m.v[1] << 1 | m.v[2] << 2 | m.v[3] << 3; }
+#endif
+    }
 
-    GLint isLinked = 0;
-    glGetProgramiv(skyboxShaderProgram, GL_LINK_STATUS, &isLinked);
-    if (isLinked == GL_FALSE) {
-        std::cerr << "Skybox shader not linked!" << std::endl;
+    //Buffer of 1/w (larger is nearer, 0 is empty) in 4x4 tiles of 64x32 pixels; widths are
+    //multiples of four so every row splits into whole SIMD groups
+    const int OCCLUSION_WIDTH = 256;
+    const int OCCLUSION_HEIGHT = 128;
+    const int OCCLUSION_TILE_WIDTH = 64;
+    const int OCCLUSION_TILE_HEIGHT = 32;
+    const int OCCLUSION_TILES_X = OCCLUSION_WIDTH / OCCLUSION_TILE_WIDTH;
+    const int OCCLUSION_TILES_Y = OCCLUSION_HEIGHT / OCCLUSION_TILE_HEIGHT;
+
+    std::vector<float> occlusionDepth(OCCLUSION_WIDTH * OCCLUSION_HEIGHT, 0.0f);
+    glm::mat4 occlusionViewProjection(1.0f);
+
+    //Screen-space triangle as three edge functions and a 1/w plane, all in pixel units.
+    //Coverage is sampled at pixel centres like the GPU does (so the two halves of a quad
+    //leave no seam), but each pixel stores the farthest depth the plane reaches inside it
+    struct OccluderTriangle {
+        float edgeA[3], edgeB[3], edgeC[3];
+        float depthA, depthB, depthC;
+        int minX, minY, maxX, maxY;
+    };
+    std::vector<OccluderTriangle> occluderTriangles;
+
+    //Clips a clip-space triangle against the near plane (z >= -w); up to four vertices
+    int clipNear(const glm::vec4 (&in)[3], glm::vec4 (&out)[4]) {
+        int count = 0;
+        for (int i = 0; i < 3; i++) {
+            const glm::vec4& current = in[i];
+            const glm::vec4& next = in[(i + 1) % 3];
+            float currentDistance = current.z + current.w;
+            float nextDistance = next.z + next.w;
+            if (currentDistance >= 0.0f) out[count++] = current;
+            if ((currentDistance >= 0.0f) != (nextDistance >= 0.0f)) {
+                float t = currentDistance / (currentDistance - nextDistance);
+                out[count++] = current + (next - current) * t;
+            }
+        }
+        return count;
     }
 
-    GLint samplerLoc = glGetUniformLocation(skyboxShaderProgram, "skybox");
-    glUniform1i(samplerLoc, 0);
+    void setupOccluderTriangle(const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) {
+        glm::vec3 v[3] = { a, b, c };
+        float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[1].y - v[0].y) * (v[2].x - v[0].x);
+        if (std::fabs(area) < 1e-6f) return;
+        if (area < 0.0f) { // both windings occlude; flip to keep "inside" positive
+            std::swap(v[1], v[2]);
+            area = -area;
+        }
 
-    glm::mat4 view = glm::mat4(glm::mat3(glm::lookAt(cameraPos, cameraPos + cameraFront, cameraUp)));
-    glm::mat4 projection = glm::perspective(glm::radians(45.0f),
-                                            (float)WINDOW_WIDTH / (float)WINDOW_HEIGHT,
-                                            0.1f, 500.0f);
+        float minX = std::min({ v[0].x, v[1].x, v[2].x });
+        float maxX = std::max({ v[0].x, v[1].x, v[2].x });
+        float minY = std::min({ v[0].y, v[1].y, v[2].y });
+        float maxY = std::max({ v[0].y, v[1].y, v[2].y });
+        OccluderTriangle triangle{};
+        triangle.minX = std::max(0, static_cast<int>(std::floor(minX)));
+        triangle.maxX = std::min(OCCLUSION_WIDTH - 1, static_cast<int>(std::floor(maxX)));
+        triangle.minY = std::max(0, static_cast<int>(std::floor(minY)));
+        triangle.maxY = std::min(OCCLUSION_HEIGHT - 1, static_cast<int>(std::floor(maxY)));
+        if (triangle.minX > triangle.maxX || triangle.minY > triangle.maxY) return;
+
+        //edge i runs from vertex i+1 to i+2, so its value at a point weights vertex i
+        for (int i = 0; i < 3; i++) {
+            const glm::vec3& from = v[(i + 1) % 3];
+            const glm::vec3& to = v[(i + 2) % 3];
+            float edgeA = from.y - to.y;
+            float edgeB = to.x - from.x;
+            triangle.edgeA[i] = edgeA;
+            triangle.edgeB[i] = edgeB;
+            triangle.edgeC[i] = -(edgeA * from.x + edgeB * from.y);
+        }
 
-    GLint viewLoc = glGetUniformLocation(skyboxShaderProgram, "view");
-    GLint projLoc = glGetUniformLocation(skyboxShaderProgram, "projection");
+        for (int i = 0; i < 3; i++) {
+            float weight = v[i].z / area;
+            triangle.depthA += triangle.edgeA[i] * weight;
+            triangle.depthB += triangle.edgeB[i] * weight;
+            triangle.depthC += triangle.edgeC[i] * weight;
+        }
+        triangle.depthC -= 0.5f * (std::fabs(triangle.depthA) + std::fabs(triangle.depthB));
+        occluderTriangles.push_back(triangle);
+    }
 
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, &view[0][0]);
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, &projection[0][0]);
+    void rasteriseOcclusionTile(int tile) {
+        int tileX0 = (tile % OCCLUSION_TILES_X) * OCCLUSION_TILE_WIDTH;
+        int tileY0 = (tile / OCCLUSION_TILES_X) * OCCLUSION_TILE_HEIGHT;
+        int tileX1 = tileX0 + OCCLUSION_TILE_WIDTH - 1;
+        int tileY1 = tileY0 + OCCLUSION_TILE_HEIGHT - 1;
 
-    glBindVertexArray(skyboxVAO);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture);
+        for (int y = tileY0; y <= tileY1; y++) {
+            std::fill_n(&occlusionDepth[y * OCCLUSION_WIDTH + tileX0], OCCLUSION_TILE_WIDTH, 0.0f);
+        }
 
-    glDrawArrays(GL_TRIANGLES, 0, 36);
-    glBindVertexArray(0);
-    glDepthFunc(GL_LESS);
+        const simd::Float4 laneOffsets = simd::lanes(0.5f, 1.5f, 2.5f, 3.5f);
+        for (const OccluderTriangle& triangle : occluderTriangles) {
+            int minX = std::max(tileX0, triangle.minX) & ~3;
+            int maxX = std::min(tileX1, triangle.maxX);
+            int minY = std::max(tileY0, triangle.minY);
+            int maxY = std::min(tileY1, triangle.maxY);
+            if (minX > maxX || minY > maxY) continue;
+
+            simd::Float4 edgeA[3], edgeZero = simd::splat(0.0f);
+            for (int i = 0; i < 3; i++) edgeA[i] = simd::splat(triangle.edgeA[i]);
+            simd::Float4 depthA = simd::splat(triangle.depthA);
+
+            for (int y = minY; y <= maxY; y++) {
+                float centreY = static_cast<float>(y) + 0.5f;
+                simd::Float4 edgeRow[3];
+                for (int i = 0; i < 3; i++) edgeRow[i] = simd::splat(triangle.edgeB[i] * centreY + triangle.edgeC[i]);
+                simd::Float4 depthRow = simd::splat(triangle.depthB * centreY + triangle.depthC);
+
+                float* row = &occlusionDepth[y * OCCLUSION_WIDTH];
+                for (int x = minX; x <= maxX; x += 4) {
+                    simd::Float4 centreX = simd::add(simd::splat(static_cast<float>(x)), laneOffsets);
+                    simd::Mask4 inside = simd::greaterEqual(simd::add(simd::mul(edgeA[0], centreX), edgeRow[0]), edgeZero);
+                    inside = simd::both(inside, simd::greaterEqual(simd::add(simd::mul(edgeA[1], centreX), edgeRow[1]), edgeZero));
+                    inside = simd::both(inside, simd::greaterEqual(simd::add(simd::mul(edgeA[2], centreX), edgeRow[2]), edgeZero));
+                    if (!simd::any(inside)) continue;
+
+                    simd::Float4 depth = simd::add(simd::mul(depthA, centreX), depthRow);
+                    simd::Float4 current = simd::load(row + x);
+                    simd::store(row + x, simd::select(inside, simd::max(current, depth), current));
+                }
+            }
+        }
+    }
+}
+
+void buildOcclusionBuffer(const glm::mat4& viewProjection) {
+    occlusionViewProjection = viewProjection;
+    occluderTriangles.clear();
+
+    for (auto& physical : physicalWorld) {
+        if (!physical->isOccluder) continue;
+
+        glm::mat4 clipFromObject = viewProjection * physical->getModelMatrix();
+        const IndexedMesh& mesh = physical->getBatch()->getMesh();
+        for (size_t first = 0; first + 3 <= mesh.indices.size(); first += 3) {
+            glm::vec4 clip[3];
+            for (int i = 0; i < 3; i++) {
+                const float* position = &mesh.vertices[mesh.indices[first + i] * 6];
+                clip[i] = clipFromObject * glm::vec4(position[0], position[1], position[2], 1.0f);
+            }
+
+            glm::vec4 clipped[4];
+            int count = clipNear(clip, clipped);
+            if (count < 3) continue;
+
+            glm::vec3 screen[4];
+            for (int i = 0; i < count; i++) {
+                float inverseW = 1.0f / std::max(clipped[i].w, 1e-6f);
+                screen[i] = glm::vec3((clipped[i].x * inverseW * 0.5f + 0.5f) * OCCLUSION_WIDTH,
+                                      (clipped[i].y * inverseW * 0.5f + 0.5f) * OCCLUSION_HEIGHT,
+                                      inverseW);
+            }
+            for (int i = 2; i < count; i++) setupOccluderTriangle(screen[0], screen[i - 1], screen[i]);
+        }
+    }
+
+    parallelFor(OCCLUSION_TILES_X * OCCLUSION_TILES_Y, rasteriseOcclusionTile);
+}
+
+bool isOccluded(const glm::vec3& minBounds, const glm::vec3& maxBounds) {
+    //screen rectangle and nearest 1/w of the box; boxes reaching the near plane are visible
+    float minX = std::numeric_limits<float>::max(), maxX = std::numeric_limits<float>::lowest();
+    float minY = minX, maxY = maxX;
+    float nearestDepth = 0.0f;
+    for (int corner = 0; corner < 8; corner++) {
+        glm::vec3 point((corner & 1) ? maxBounds.x : minBounds.x,
+                        (corner & 2) ? maxBounds.y : minBounds.y,
+                        (corner & 4) ? maxBounds.z : minBounds.z);
+        glm::vec4 clip = occlusionViewProjection * glm::vec4(point, 1.0f);
+        if (clip.z < -clip.w || clip.w <= 1e-6f) return false;
+
+        float inverseW = 1.0f / clip.w;
+        float x = (clip.x * inverseW * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+        float y = (clip.y * inverseW * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+        minX = std::min(minX, x);
+        maxX = std::max(maxX, x);
+        minY = std::min(minY, y);
+        maxY = std::max(maxY, y);
+        nearestDepth = std::max(nearestDepth, inverseW);
+    }
+
+    int x0 = std::max(0, static_cast<int>(std::floor(minX)));
+    int x1 = std::min(OCCLUSION_WIDTH - 1, static_cast<int>(std::floor(maxX)));
+    int y0 = std::max(0, static_cast<int>(std::floor(minY)));
+    int y1 = std::min(OCCLUSION_HEIGHT - 1, static_cast<int>(std::floor(maxY)));
+    if (x0 > x1 || y0 > y1) return false; // off screen is the frustum test's call
+
+    //visible if any pixel under the rectangle holds something farther than the box
+    const simd::Float4 laneIndices = simd::lanes(0.0f, 1.0f, 2.0f, 3.0f);
+    simd::Float4 boxDepth = simd::splat(nearestDepth);
+    simd::Float4 firstColumn = simd::splat(static_cast<float>(x0));
+    simd::Float4 pastLastColumn = simd::splat(static_cast<float>(x1 + 1));
+    for (int y = y0; y <= y1; y++) {
+        const float* row = &occlusionDepth[y * OCCLUSION_WIDTH];
+        for (int x = x0 & ~3; x <= x1; x += 4) {
+            simd::Float4 column = simd::add(simd::splat(static_cast<float>(x)), laneIndices);
+            simd::Mask4 inRange = simd::both(simd::greaterEqual(column, firstColumn), simd::less(column, pastLastColumn));
+            if (simd::any(simd::both(inRange, simd::less(simd::load(row + x), boxDepth)))) return false;
+        }
+    }
+    return true;
+}
+
+//Lighting
+
+std::vector<PointLight> pointLights;
+
+namespace {
+    const int CLUSTER_TILES = CLUSTER_TILES_X * CLUSTER_TILES_Y;
+    const int CLUSTER_COUNT = CLUSTER_TILES * CLUSTER_SLICES;
+
+    //Texture buffers: light data (RGBA32F, two texels per light), the froxel grid (RG32UI,
+    //first index and count) and the index list (R32UI). The textures stay bound to their
+    //units for the life of the engine; only the buffers are refilled each frame
+    unsigned int lightBuffers[3];
+    unsigned int lightTextures[3];
+
+    //view-space bounds of every froxel; they depend only on the projection
+    std::vector<glm::vec3> clusterMin, clusterMax;
+
+    float sliceDepth(int slice) {
+        return CAMERA_NEAR * std::pow(CAMERA_FAR / CAMERA_NEAR, static_cast<float>(slice) / CLUSTER_SLICES);
+    }
+
+    void buildClusterBounds() {
+        clusterMin.resize(CLUSTER_COUNT);
+        clusterMax.resize(CLUSTER_COUNT);
+        float tanY = std::tan(glm::radians(CAMERA_FOV) * 0.5f);
+        float tanX = tanY * WINDOW_WIDTH / WINDOW_HEIGHT;
+
+        for (int slice = 0; slice < CLUSTER_SLICES; slice++) {
+            const float depths[2] = { sliceDepth(slice), sliceDepth(slice + 1) };
+            for (int y = 0; y < CLUSTER_TILES_Y; y++) {
+                for (int x = 0; x < CLUSTER_TILES_X; x++) {
+                    const float ndcX[2] = { -1.0f + 2.0f * x / CLUSTER_TILES_X, -1.0f + 2.0f * (x + 1) / CLUSTER_TILES_X };
+                    const float ndcY[2] = { -1.0f + 2.0f * y / CLUSTER_TILES_Y, -1.0f + 2.0f * (y + 1) / CLUSTER_TILES_Y };
+
+                    glm::vec3 lo(std::numeric_limits<float>::max());
+                    glm::vec3 hi(-std::numeric_limits<float>::max());
+                    for (float depth : depths) {
+                        for (float nx : ndcX) {
+                            for (float ny : ndcY) {
+                                glm::vec3 corner(nx * tanX * depth, ny * tanY * depth, -depth);
+                                lo = glm::min(lo, corner);
+                                hi = glm::max(hi, corner);
+                            }
+                        }
+                    }
+                    int cluster = slice * CLUSTER_TILES + y * CLUSTER_TILES_X + x;
+                    clusterMin[cluster] = lo;
+                    clusterMax[cluster] = hi;
+                }
+            }
+        }
+    }
+
+    //Lights whose depth range overlaps one slice, as structure-of-arrays padded to whole
+    //SIMD groups, and the slice's output: per-tile counts and the indices tile by tile
+    struct SliceLights {
+        std::vector<float> x, y, z, radiusSq;
+        std::vector<uint32_t> light;
+        std::vector<uint32_t> indices;
+        uint32_t counts[CLUSTER_TILES];
+    };
+    SliceLights sliceLights[CLUSTER_SLICES];
+
+    std::vector<glm::vec4> viewLights; // view-space centre and radius of each visible light
+    std::vector<glm::vec4> lightTexels;
+    std::vector<uint32_t> clusterGrid;
+    std::vector<uint32_t> lightIndexList;
+
+    void assignSlice(int slice) {
+        SliceLights& lights = sliceLights[slice];
+        lights.x.clear();
+        lights.y.clear();
+        lights.z.clear();
+        lights.radiusSq.clear();
+        lights.light.clear();
+        lights.indices.clear();
+
+        float nearDepth = sliceDepth(slice);
+        float farDepth = sliceDepth(slice + 1);
+        for (size_t i = 0; i < viewLights.size(); i++) {
+            const glm::vec4& light = viewLights[i];
+            if (-light.z + light.w < nearDepth || -light.z - light.w > farDepth) continue;
+            lights.x.push_back(light.x);
+            lights.y.push_back(light.y);
+            lights.z.push_back(light.z);
+            lights.radiusSq.push_back(light.w * light.w);
+            lights.light.push_back(static_cast<uint32_t>(i));
+        }
+        //padding lanes have a negative squared radius, so they never pass
+        while (lights.x.size() % 4 != 0) {
+            lights.x.push_back(0.0f);
+            lights.y.push_back(0.0f);
+            lights.z.push_back(0.0f);
+            lights.radiusSq.push_back(-1.0f);
+            lights.light.push_back(0);
+        }
+
+        const simd::Float4 zero = simd::splat(0.0f);
+        for (int tile = 0; tile < CLUSTER_TILES; tile++) {
+            int cluster = slice * CLUSTER_TILES + tile;
+            const glm::vec3& lo = clusterMin[cluster];
+            const glm::vec3& hi = clusterMax[cluster];
+            simd::Float4 minX = simd::splat(lo.x), minY = simd::splat(lo.y), minZ = simd::splat(lo.z);
+            simd::Float4 maxX = simd::splat(hi.x), maxY = simd::splat(hi.y), maxZ = simd::splat(hi.z);
+
+            uint32_t count = 0;
+            for (size_t i = 0; i < lights.x.size(); i += 4) {
+                simd::Float4 cx = simd::load(&lights.x[i]);
+                simd::Float4 cy = simd::load(&lights.y[i]);
+                simd::Float4 cz = simd::load(&lights.z[i]);
+
+                //distance from each centre to the box along each axis, zero inside it
+                simd::Float4 dx = simd::max(simd::max(simd::sub(minX, cx), simd::sub(cx, maxX)), zero);
+                simd::Float4 dy = simd::max(simd::max(simd::sub(minY, cy), simd::sub(cy, maxY)), zero);
+                simd::Float4 dz = simd::max(simd::max(simd::sub(minZ, cz), simd::sub(cz, maxZ)), zero);
+                simd::Float4 distanceSq = simd::add(simd::add(simd::mul(dx, dx), simd::mul(dy, dy)), simd::mul(dz, dz));
+
+                int hits = simd::laneMask(simd::less(distanceSq, simd::load(&lights.radiusSq[i])));
+                for (int lane = 0; hits != 0; lane++, hits >>= 1) {
+                    if (hits & 1) {
+                        lights.indices.push_back(lights.light[i + lane]);
+                        count++;
+                    }
+                }
+            }
+            lights.counts[tile] = count;
+        }
+    }
+
+    void uploadTextureBuffer(unsigned int buffer, const void* data, size_t size) {
+        glState.bindBuffer(GL_TEXTURE_BUFFER, buffer);
+        //reallocating orphans last frame's storage instead of waiting on the GPU
+        glBufferData(GL_TEXTURE_BUFFER, static_cast<GLsizeiptr>(std::max<size_t>(size, 16)), nullptr, GL_STREAM_DRAW);
+        if (size > 0) glBufferSubData(GL_TEXTURE_BUFFER, 0, static_cast<GLsizeiptr>(size), data);
+    }
+}
+
+void initLighting() {
+    const GLenum formats[3] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+    glGenBuffers(3, lightBuffers);
+    glGenTextures(3, lightTextures);
+    for (int i = 0; i < 3; i++) {
+        uploadTextureBuffer(lightBuffers[i], nullptr, 0);
+        glState.activeTexture(GL_TEXTURE0 + LIGHT_TEXTURE_UNIT + i);
+        glState.bindTexture(GL_TEXTURE_BUFFER, lightTextures[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, formats[i], lightBuffers[i]);
+    }
+    glState.activeTexture(GL_TEXTURE0);
+
+    for (unsigned int id : { shaderProgram, instancedShaderProgram }) {
+        ShaderProgram& program = getShaderProgram(id);
+        program.use();
+        program.setInt(program.uniform("uLightData"), LIGHT_TEXTURE_UNIT);
+        program.setInt(program.uniform("uClusterGrid"), LIGHT_TEXTURE_UNIT + 1);
+        program.setInt(program.uniform("uLightIndices"), LIGHT_TEXTURE_UNIT + 2);
+    }
+}
+
+void updateLightClusters(const glm::mat4& view) {
+    if (clusterMin.empty()) buildClusterBounds();
+
+    viewLights.clear();
+    lightTexels.clear();
+    for (const PointLight& light : pointLights) {
+        if (viewLights.size() == MAX_VISIBLE_LIGHTS) break;
+        glm::vec3 extent(light.radius);
+        if (light.radius <= 0.0f || !viewFrustum.intersects(light.position - extent, light.position + extent)) continue;
+
+        glm::vec4 centre = view * glm::vec4(light.position, 1.0f);
+        viewLights.push_back(glm::vec4(centre.x, centre.y, centre.z, light.radius));
+        lightTexels.push_back(glm::vec4(light.position, light.radius));
+        lightTexels.push_back(glm::vec4(light.colour * light.intensity, 0.0f));
+    }
+    frameStats.lightsVisible = static_cast<unsigned int>(viewLights.size());
+
+    parallelFor(CLUSTER_SLICES, assignSlice);
+
+    //the slices' lists are concatenated in order; each froxel records where its run starts
+    clusterGrid.resize(CLUSTER_COUNT * 2);
+    lightIndexList.clear();
+    for (int slice = 0; slice < CLUSTER_SLICES; slice++) {
+        const SliceLights& lights = sliceLights[slice];
+        auto start = static_cast<uint32_t>(lightIndexList.size());
+        for (int tile = 0; tile < CLUSTER_TILES; tile++) {
+            int cluster = slice * CLUSTER_TILES + tile;
+            clusterGrid[cluster * 2] = start;
+            clusterGrid[cluster * 2 + 1] = lights.counts[tile];
+            start += lights.counts[tile];
+        }
+        lightIndexList.insert(lightIndexList.end(), lights.indices.begin(), lights.indices.end());
+    }
+    frameStats.lightIndices = static_cast<unsigned int>(lightIndexList.size());
+
+    uploadTextureBuffer(lightBuffers[0], lightTexels.data(), lightTexels.size() * sizeof(glm::vec4));
+    uploadTextureBuffer(lightBuffers[1], clusterGrid.data(), clusterGrid.size() * sizeof(uint32_t));
+    uploadTextureBuffer(lightBuffers[2], lightIndexList.data(), lightIndexList.size() * sizeof(uint32_t));
+}
+
+//Shadows
+
+namespace {
+    //The live atlas is sampled by the lit shaders (depth compare on); the static atlas only
+    //holds the cached static casters and is copied into it tile by tile
+    unsigned int shadowAtlas = 0, staticShadowAtlas = 0;
+    unsigned int shadowFramebuffer = 0, staticShadowFramebuffer = 0;
+    int lightViewProjectionSlot = -1;
+
+    struct ShadowCascade {
+        glm::mat4 lightViewProjection{1.0f};
+        bool updated = false;      // drawn at least once
+        bool staticDirty = true;   // cached static casters need redrawing
+    };
+    ShadowCascade shadowCascades[SHADOW_CASCADES];
+    unsigned int shadowFrame = 0;
+    bool staticShadowsInvalid = true;
+
+    //physicalWorld split by isStatic, once per update. The previous static list and model
+    //matrices detect static Physicals being added, removed, (un)marked or moved
+    std::vector<Physical*> staticCasters, dynamicCasters, previousStaticCasters;
+    std::vector<glm::mat4> staticModels, previousStaticModels;
+
+    struct ShadowCaster {
+        MeshBatch* batch;
+        InstanceData instance;
+    };
+    std::vector<ShadowCaster> shadowCasters;
+    std::vector<InstanceData> shadowInstances;
+
+    void createShadowAtlas() {
+        const int size = 2 * SHADOW_TILE_SIZE;
+        unsigned int textures[2], framebuffers[2];
+        glGenTextures(2, textures);
+        glGenFramebuffers(2, framebuffers);
+        for (int i = 0; i < 2; i++) {
+            glState.activeTexture(GL_TEXTURE0 + SHADOW_TEXTURE_UNIT);
+            glState.bindTexture(GL_TEXTURE_2D, textures[i]);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size, size, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, nullptr);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, i == 0 ? GL_LINEAR : GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, i == 0 ? GL_LINEAR : GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            if (i == 0) {
+                //hardware 2x2 percentage-closer filtering
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+            }
+
+            glState.bindFramebuffer(framebuffers[i]);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, textures[i], 0);
+            glDrawBuffer(GL_NONE);
+            glReadBuffer(GL_NONE);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+                std::cerr << "Shadow atlas framebuffer incomplete" << std::endl;
+            }
+        }
+        glState.bindFramebuffer(0);
+
+        //the live atlas stays bound to its unit from here on
+        glState.bindTexture(GL_TEXTURE_2D, textures[0]);
+        glState.activeTexture(GL_TEXTURE0);
+
+        shadowAtlas = textures[0];
+        staticShadowAtlas = textures[1];
+        shadowFramebuffer = framebuffers[0];
+        staticShadowFramebuffer = framebuffers[1];
+    }
+
+    //Light-space box around the camera, snapped to a quarter of its radius so it only moves
+    //(and invalidates the cached static casters) once the camera has travelled that far
+    glm::mat4 cascadeMatrix(int cascade, const glm::mat4& lightView) {
+        float radius = SHADOW_CASCADE_SPLITS[cascade];
+        float step = radius / 4.0f;
+        glm::vec4 centre = lightView * glm::vec4(cameraPos, 1.0f);
+        centre.x = std::floor(centre.x / step) * step;
+        centre.y = std::floor(centre.y / step) * step;
+        centre.z = std::floor(centre.z / step) * step;
+
+        //padded by a step so the snapped box still holds the whole cascade sphere
+        float extent = radius + step;
+        glm::mat4 projection = glm::ortho(centre.x - extent, centre.x + extent,
+                                          centre.y - extent, centre.y + extent,
+                                          -(centre.z + extent + SHADOW_CASTER_RANGE), -(centre.z - extent));
+        return projection * lightView;
+    }
+
+    //Returns true if the static casters differ from the previous update
+    bool gatherShadowCasters() {
+        previousStaticCasters.swap(staticCasters);
+        previousStaticModels.swap(staticModels);
+        staticCasters.clear();
+        staticModels.clear();
+        dynamicCasters.clear();
+
+        bool changed = false;
+        for (auto& physical : physicalWorld) {
+            if (!physical->isStatic) {
+                dynamicCasters.push_back(physical.get());
+                continue;
+            }
+            size_t index = staticCasters.size();
+            staticCasters.push_back(physical.get());
+            staticModels.push_back(physical->getModelMatrix());
+
+            //a mesh that no longer matches its batch is about to be rebuilt with new geometry
+            changed = changed || index >= previousStaticCasters.size() ||
+                      previousStaticCasters[index] != physical.get() ||
+                      previousStaticModels[index] != staticModels[index] ||
+                      !physical->isMeshCompiled();
+        }
+        return changed || staticCasters.size() != previousStaticCasters.size();
+    }
+
+    //Draws the casters inside the light box into the bound atlas tile, one instanced draw
+    //per mesh. Returns how many were drawn
+    unsigned int drawShadowCasters(const glm::mat4& lightViewProjection, const std::vector<Physical*>& casters) {
+        Frustum lightFrustum = Frustum::fromMatrix(lightViewProjection);
+        shadowCasters.clear();
+        for (Physical* physical : casters) {
+            const std::shared_ptr<MeshBatch>& batch = physical->getBatch();
+            if (batch->getIndexCount() == 0) continue;
+
+            glm::vec3 minBounds, maxBounds;
+            physical->getWorldBounds(minBounds, maxBounds);
+            if (!lightFrustum.intersects(minBounds, maxBounds)) continue;
+            shadowCasters.push_back({ batch.get(), InstanceData::make(physical->getModelMatrix(), physical->colour) });
+        }
+        if (shadowCasters.empty()) return 0;
+
+        std::sort(shadowCasters.begin(), shadowCasters.end(),
+                  [](const ShadowCaster& a, const ShadowCaster& b) { return a.batch->getId() < b.batch->getId(); });
+
+        ShaderProgram& program = getShaderProgram(shadowShaderProgram);
+        program.use();
+        program.setMat4(lightViewProjectionSlot, lightViewProjection);
+        for (size_t i = 0; i < shadowCasters.size();) {
+            MeshBatch* batch = shadowCasters[i].batch;
+            shadowInstances.clear();
+            size_t end = i;
+            for (; end < shadowCasters.size() && shadowCasters[end].batch == batch; end++) {
+                shadowInstances.push_back(shadowCasters[end].instance);
+            }
+            batch->bind();
+            batch->setDecodeUniforms(program);
+            batch->drawInstanced(shadowInstances.data(), static_cast<int>(end - i));
+            i = end;
+        }
+        return static_cast<unsigned int>(shadowCasters.size());
+    }
+
+    void updateCascade(int cascade, const glm::mat4& lightViewProjection) {
+        ShadowCascade& state = shadowCascades[cascade];
+        int x = (cascade % 2) * SHADOW_TILE_SIZE;
+        int y = (cascade / 2) * SHADOW_TILE_SIZE;
+        glViewport(x, y, SHADOW_TILE_SIZE, SHADOW_TILE_SIZE);
+        glScissor(x, y, SHADOW_TILE_SIZE, SHADOW_TILE_SIZE);
+
+        if (state.staticDirty) {
+            glState.bindFramebuffer(staticShadowFramebuffer);
+            glClear(GL_DEPTH_BUFFER_BIT);
+            frameStats.shadowCastersStatic += drawShadowCasters(lightViewProjection, staticCasters);
+            state.staticDirty = false;
+        }
+
+        //start from the cached statics, then add everything that moves
+        glState.bindFramebuffer(shadowFramebuffer);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, staticShadowFramebuffer);
+        glBlitFramebuffer(x, y, x + SHADOW_TILE_SIZE, y + SHADOW_TILE_SIZE,
+                          x, y, x + SHADOW_TILE_SIZE, y + SHADOW_TILE_SIZE, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, shadowFramebuffer);
+        frameStats.shadowCastersDynamic += drawShadowCasters(lightViewProjection, dynamicCasters);
+
+        state.lightViewProjection = lightViewProjection;
+        state.updated = true;
+    }
+}
+
+void initShadows() {
+    for (unsigned int id : { shaderProgram, instancedShaderProgram, deferredLightingShaderProgram }) {
+        if (id == 0) continue;
+        ShaderProgram& program = getShaderProgram(id);
+        program.use();
+        program.setInt(program.uniform("uShadowAtlas"), SHADOW_TEXTURE_UNIT);
+    }
+    lightViewProjectionSlot = getShaderProgram(shadowShaderProgram).uniform("uLightViewProjection");
+}
+
+void updateShadowMaps(FrameGlobals& globals) {
+    globals.cascadeSplits = glm::vec4(0.0f);
+    if (!shadowsEnabled) return;
+    if (shadowAtlas == 0) createShadowAtlas();
+
+    glm::vec3 lightDirection = glm::length(sceneLightPos) > 0.0f ? -glm::normalize(sceneLightPos) : glm::vec3(0.0f, -1.0f, 0.0f);
+    glm::vec3 up = std::fabs(lightDirection.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+    glm::mat4 lightView = glm::lookAt(glm::vec3(0.0f), lightDirection, up);
+
+    bool staticsChanged = gatherShadowCasters() || staticShadowsInvalid;
+    staticShadowsInvalid = false;
+
+    glState.enable(GL_DEPTH_TEST);
+    glState.depthMask(true);
+    glState.depthFunc(GL_LESS);
+    glState.disable(GL_BLEND);
+    glState.enable(GL_SCISSOR_TEST);
+    glState.enable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(2.0f, 4.0f);
+
+    for (int cascade = 0; cascade < SHADOW_CASCADES; cascade++) {
+        ShadowCascade& state = shadowCascades[cascade];
+        if (staticsChanged) state.staticDirty = true;
+
+        //cascade n runs on frames where shadowFrame mod 2^n is 2^(n-1), so no two distant ones coincide
+        bool due = cascade == 0 || shadowFrame % (1u << cascade) == (1u << (cascade - 1));
+        if (!due && state.updated) continue;
+
+        glm::mat4 lightViewProjection = cascadeMatrix(cascade, lightView);
+        if (lightViewProjection != state.lightViewProjection) state.staticDirty = true;
+        updateCascade(cascade, lightViewProjection);
+    }
+    shadowFrame++;
+
+    glState.disable(GL_POLYGON_OFFSET_FILL);
+    glState.disable(GL_SCISSOR_TEST);
+    glState.bindFramebuffer(sceneFramebuffer);
+    glViewport(0, 0, renderWidth, renderHeight);
+
+    //atlas tile c covers [0.5 * (c % 2), 0.5 * (c / 2)] plus half a unit in u and v
+    for (int cascade = 0; cascade < SHADOW_CASCADES; cascade++) {
+        glm::vec3 offset(0.25f + 0.5f * (cascade % 2), 0.25f + 0.5f * (cascade / 2), 0.5f);
+        glm::mat4 toAtlas = glm::scale(glm::translate(glm::mat4(1.0f), offset), glm::vec3(0.25f, 0.25f, 0.5f));
+        globals.shadowMatrices[cascade] = toAtlas * shadowCascades[cascade].lightViewProjection;
+        globals.cascadeSplits[cascade] = SHADOW_CASCADE_SPLITS[cascade];
+    }
+}
+
+void invalidateStaticShadows() {
+    staticShadowsInvalid = true;
+}
+
+//Level of detail
+
+namespace {
+    //Approximate on-screen diameter in pixels of a world-space box (its bounding sphere)
+    float projectedSize(const glm::vec3& minBounds, const glm::vec3& maxBounds) {
+        float radius = glm::length(maxBounds - minBounds) * 0.5f;
+        float distance = glm::length((minBounds + maxBounds) * 0.5f - cameraPos);
+        if (distance <= radius) return std::numeric_limits<float>::max();
+        return radius / distance * WINDOW_HEIGHT / std::tan(glm::radians(CAMERA_FOV) * 0.5f);
+    }
+
+    //Moves from the current level only once the size clears a boundary by the hysteresis
+    //margin; level L (from 1) begins below lodPixelSize / 2^(L - 1)
+    int selectLod(int current, int levelCount, float size) {
+        auto boundary = [](int level) { return lodPixelSize / static_cast<float>(1 << (level - 1)); };
+        int level = std::min(std::max(current, 0), levelCount - 1);
+        while (level > 0 && size > boundary(level) * (1.0f + LOD_HYSTERESIS)) level--;
+        while (level + 1 < levelCount && size < boundary(level + 1) * (1.0f - LOD_HYSTERESIS)) level++;
+        return level;
+    }
 }
 
+//Render list construction
+namespace {
+    //One job's share of drawScene: the commands it built, sort keys included, and its
+    //counts. Batches are referenced, not copied, so workers never touch a shared refcount
+    struct SceneChunk {
+        struct Item {
+            const std::shared_ptr<MeshBatch>* batch;
+            InstanceData instance;
+            RenderPass pass;
+            uint64_t key;
+        };
+        std::vector<Item> items;
+        std::vector<Physical*> unready;
+        unsigned int submitted = 0, culled = 0, occluded = 0, trianglesSaved = 0;
+
+        void clear() {
+            items.clear();
+            unready.clear();
+            submitted = culled = occluded = trianglesSaved = 0;
+        }
+    };
+
+    const size_t SCENE_CHUNK_SIZE = 512;
+    std::vector<SceneChunk> sceneChunks;
+    SceneChunk mainThreadChunk;
+
+    //Culls one Physical and, if visible, picks its detail level and records its command.
+    //Off the main thread, a Physical whose batch or detail levels still have to be built
+    //is only noted in chunk.unready
+    void buildSceneItem(Physical* physical, SceneChunk& chunk, bool mainThread) {
+        if (!mainThread && (!physical->isMeshCompiled() || (lodEnabled && !physical->getBatch()->lodsReady()))) {
+            chunk.unready.push_back(physical);
+            return;
+        }
+
+        glm::vec3 minBounds(0.0f), maxBounds(0.0f);
+        if (frustumCullingEnabled || occlusionCullingEnabled || lodEnabled) {
+            physical->getWorldBounds(minBounds, maxBounds);
+        }
+        if (frustumCullingEnabled && !viewFrustum.intersects(minBounds, maxBounds)) {
+            chunk.culled++;
+            return;
+        }
+        if (occlusionCullingEnabled && !physical->isOccluder && isOccluded(minBounds, maxBounds)) {
+            chunk.occluded++;
+            return;
+        }
+        chunk.submitted++;
+
+        const std::shared_ptr<MeshBatch>& fullMesh = physical->getBatch();
+        physical->lodLevel = lodEnabled
+                ? selectLod(physical->lodLevel, fullMesh->getLodCount(), projectedSize(minBounds, maxBounds))
+                : 0;
+        const std::shared_ptr<MeshBatch>& mesh = physical->getLodBatch(physical->lodLevel);
+        chunk.trianglesSaved += fullMesh->getTriangleCount() - mesh->getTriangleCount();
+        if (mesh->getIndexCount() == 0) return;
+
+        RenderPass pass = physical->colour.a < 1.0f ? RenderPass::Translucent : RenderPass::Opaque;
+        glm::mat4 model = physical->getModelMatrix();
+        float distance = glm::length(glm::vec3(model[3]) - cameraPos);
+        chunk.items.push_back({ &mesh, InstanceData::make(model, physical->colour), pass,
+                                makeSortKey(pass, instancedShaderProgram, mesh->getId(), distance) });
+    }
+
+    void queueSceneChunk(const SceneChunk& chunk) {
+        for (const SceneChunk::Item& item : chunk.items) {
+            sortEntries.push_back({ item.key, static_cast<uint32_t>(renderCommands.size()) });
+            renderCommands.push_back({ item.pass, instancedShaderProgram, true, *item.batch, item.instance });
+        }
+        frameStats.objectsSubmitted += chunk.submitted;
+        frameStats.objectsCulled += chunk.culled;
+        frameStats.objectsOccluded += chunk.occluded;
+        frameStats.trianglesSaved += chunk.trianglesSaved;
+    }
+}
+
+//Queues every visible Physical; the render queue sorts them and draws Physicals sharing a
+//mesh as one instanced call per run. Partly transparent colours go to the translucent pass.
+//Culling, LOD selection, instance data and sort keys are built in chunks on the worker
+//threads; only the merge into the queue (and any mesh building) stays on this thread
 void drawScene(){
-    for (auto& physical : physicalWorld){
-        physical->draw(shaderProgram);
+    waitForSimulation();
+    size_t chunkCount = (physicalWorld.size() + SCENE_CHUNK_SIZE - 1) / SCENE_CHUNK_SIZE;
+    if (sceneChunks.size() < chunkCount) sceneChunks.resize(chunkCount);
+
+    parallelFor(static_cast<int>(chunkCount), [](int index) {
+        SceneChunk& chunk = sceneChunks[index];
+        chunk.clear();
+        size_t end = std::min(physicalWorld.size(), (index + 1) * SCENE_CHUNK_SIZE);
+        for (size_t i = index * SCENE_CHUNK_SIZE; i < end; i++) {
+            buildSceneItem(physicalWorld[i].get(), chunk, false);
+        }
+    });
+
+    size_t total = renderCommands.size();
+    for (size_t i = 0; i < chunkCount; i++) total += sceneChunks[i].items.size();
+    renderCommands.reserve(total);
+    sortEntries.reserve(total);
+
+    //merged before the main thread builds anything, since that may move the batches items point into
+    mainThreadChunk.clear();
+    for (size_t i = 0; i < chunkCount; i++) queueSceneChunk(sceneChunks[i]);
+    for (size_t i = 0; i < chunkCount; i++) {
+        for (Physical* physical : sceneChunks[i].unready) buildSceneItem(physical, mainThreadChunk, true);
     }
+    queueSceneChunk(mainThreadChunk);
 }
 
 //Physics
@@ -10,12 +10,20 @@ struct GLFWwindow;
 const float WINDOW_WIDTH = 1200;
 const float WINDOW_HEIGHT = 900;
 
+//Vertical field of view of the camera, in degrees
+const float CAMERA_FOV = 45.0f;
+
+//Near and far clip planes of the camera
+const float CAMERA_NEAR = 0.1f;
+const float CAMERA_FAR = 2000.0f;
+
 //Time
 extern float deltaTime;
 extern float lastFrameTime;
 
 //Global game control variables
 extern bool skyboxEnabled;
+extern unsigned int skyboxShaderProgram;
 extern bool gameActive;
 
 #pragma once
@@ -23,6 +31,10 @@ extern bool gameActive;
 #include <vector>
 #include <memory>
 #include <limits>
+#include <string>
+#include <unordered_map>
+#include <functional>
+#include <cstdint>
 
 //CAMERAS
 
@@ -48,8 +60,148 @@ public:
 //Function to set current camera to target Camera object
 void setCamera(Camera target);
 
+//GL STATE
+
+//Per-frame engine counters; frameStats accumulates the current frame and is copied to
+//lastFrameStats (complete numbers for the previous frame) in engineBeginFrame
+struct FrameStats {
+    unsigned int stateCalls = 0;
+    unsigned int stateCallsFiltered = 0;
+    unsigned int objectsSubmitted = 0;
+    unsigned int objectsCulled = 0;
+    unsigned int objectsOccluded = 0;
+    unsigned int trianglesSaved = 0;
+    unsigned int lightsVisible = 0;
+    unsigned int lightIndices = 0;
+    unsigned int shadowCastersStatic = 0;
+    unsigned int shadowCastersDynamic = 0;
+    float resolutionScale = 1.0f;
+    float gpuSceneMilliseconds = 0.0f; // latest timer query result, a few frames old
+};
+extern FrameStats frameStats;
+extern FrameStats lastFrameStats;
+
+//Prints lastFrameStats to stdout
+void logFrameStats();
+
+//Shadow copy of the GL binding and fixed-function state the engine touches. Requests
+//that match what is already current are dropped (and counted in frameStats) instead of
+//reaching the driver. All engine code goes through here; anything that changes this state
+//behind its back must call invalidate() afterwards. GLenum parameters are plain unsigned
+//ints so this header does not need the GL loader
+class GLStateCache {
+public:
+    void useProgram(unsigned int program);
+    void bindVertexArray(unsigned int vao);
+    void bindBuffer(unsigned int target, unsigned int buffer);
+    void activeTexture(unsigned int unit);
+    void bindTexture(unsigned int target, unsigned int texture);
+
+    void setEnabled(unsigned int capability, bool enabled);
+    void enable(unsigned int capability) { setEnabled(capability, true); }
+    void disable(unsigned int capability) { setEnabled(capability, false); }
+    void depthMask(bool writeDepth);
+    void depthFunc(unsigned int func);
+    void blendFunc(unsigned int source, unsigned int destination);
+    void colorMask(bool red, bool green, bool blue, bool alpha);
+    void bindFramebuffer(unsigned int framebuffer);
+
+    //Deleting through the cache keeps it from assuming a recycled id is still bound
+    void deleteProgram(unsigned int program);
+    void deleteVertexArray(unsigned int vao);
+    void deleteBuffer(unsigned int buffer);
+    void deleteTexture(unsigned int texture);
+    void deleteFramebuffer(unsigned int framebuffer);
+
+    //Forgets everything, so the next request for each piece of state is always issued
+    void invalidate();
+
+private:
+    static constexpr unsigned int UNKNOWN = 0xFFFFFFFFu;
+
+    unsigned int program = UNKNOWN;
+    unsigned int vertexArray = UNKNOWN;
+    unsigned int textureUnit = UNKNOWN;
+    unsigned int framebuffer = UNKNOWN;
+    unsigned int depthFunction = UNKNOWN;
+    unsigned int blendSource = UNKNOWN;
+    unsigned int blendDestination = UNKNOWN;
+    int depthWrite = -1;
+    int colorWrite = -1;
+
+    std::unordered_map<unsigned int, unsigned int> buffers;
+    std::unordered_map<unsigned long long, unsigned int> textures;
+    std::unordered_map<unsigned int, bool> capabilities;
+
+    //Counts the request and reports whether it has to reach the driver
+    static bool needsCall(bool redundant);
+};
+
+extern GLStateCache& glState;
+
+//JOBS
+
+//Runs job(0) .. job(count - 1) on the engine's worker threads, with the calling thread
+//helping, and returns once all have finished. Jobs must not call parallelFor themselves;
+//only the main thread submits work
+void parallelFor(int count, const std::function<void(int)>& job);
+
 //GEOMETRY AND RENDERING
 
+//Linked GL program with every active uniform resolved once after link. Setters take the
+//slot handle from uniform() (or one of the engine handles below), so the per-draw path
+//does no string lookups, and they skip the upload when the program already holds that
+//value. Setters upload to the current program, so call use() first.
+//Programs declaring the FrameGlobals block are attached to the per-frame uniform buffer
+class ShaderProgram {
+public:
+    unsigned int id = 0;
+
+    //Handles for the uniforms the engine sets itself; -1 where the program lacks them
+    int colorUniform = -1;
+    int modelUniform = -1;
+    int normalMatrixUniform = -1;
+    int positionOriginUniform = -1;
+    int positionExtentUniform = -1;
+
+    explicit ShaderProgram(unsigned int programId);
+
+    //Slot for an active uniform, or -1 if the program has none by that name.
+    //Resolve once at setup time; this is a hash lookup
+    [[nodiscard]] int uniform(const std::string& name) const;
+
+    void use() const;
+    void setInt(int slot, int value);
+    void setFloat(int slot, float value);
+    void setVec2(int slot, const glm::vec2& value);
+    void setVec3(int slot, const glm::vec3& value);
+    void setVec4(int slot, const glm::vec4& value);
+    void setMat3(int slot, const glm::mat3& value);
+    void setMat4(int slot, const glm::mat4& value);
+
+private:
+    struct Uniform {
+        int location;
+        bool hasValue = false;
+        float value[16];
+    };
+    std::vector<Uniform> uniforms;
+    std::unordered_map<std::string, int> slots;
+
+    //Updates the cached copy and reports whether the driver actually needs the new value
+    bool changed(int slot, const float* data, size_t count);
+};
+
+//Returns the wrapper for a program id, resolving its uniforms the first time it is seen
+ShaderProgram& getShaderProgram(unsigned int programId);
+
+//Immediate-mode drawing for throwaway per-frame geometry. Vertices are written into a
+//streaming ring buffer instead of fresh GL objects. Geometry for the engine's main program
+//is held until the render queue flushes and merged into as few draws as possible; any other
+//program is drawn straight away from the ring with its uColor uniform
+void drawTransient(unsigned int program, glm::vec4 colour, const glm::vec3* positions, int vertexCount,
+                   glm::vec3 offset);
+
 //Basic geometry classes (including generic "Shape")
 class Shape {
 public:
@@ -75,41 +227,8 @@ public:
 
     void drawWithOffset(unsigned int currentShaderProgram, glm::vec4 color,
                         float xOffset, float yOffset, float zOffset) const override{
-        float vertices[] = {
-                a.x + xOffset, a.y + yOffset, a.z + zOffset, 0.0f, 1.0f, 0.0f,
-                b.x + xOffset, b.y + yOffset, b.z + zOffset, 0.0f, 1.0f, 0.0f,
-                c.x + xOffset, c.y + yOffset, c.z + zOffset, 0.0f, 1.0f, 0.0f
-        };
-        unsigned int VAO, VBO;
-
-        int colorLoc = glGetUniformLocation(currentShaderProgram, "uColor");
-        glUniform4f(colorLoc, color.r, color.g, color.b, color.a);
-
-        glGenVertexArrays(1, &VAO);
-        glGenBuffers(1, &VBO);
-
-        glBindVertexArray(VAO);
-        glBindBuffer(GL_ARRAY_BUFFER, VBO);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
-        glEnableVertexAttribArray(1);
-
-        glUseProgram(currentShaderProgram);
-
-        //light position
-        glm::vec3 lightPos = glm::vec3(0.0f, 100.0f, 0.0f); // above the scene
-        glUniform3fv(glGetUniformLocation(currentShaderProgram, "lightPos"), 1, &lightPos[0]);
-
-        //view position
-        glUniform3fv(glGetUniformLocation(currentShaderProgram, "viewPos"), 1, &cameraPos[0]);
-
-        glDrawArrays(GL_TRIANGLES, 0, 3);
-
-        glDeleteVertexArrays(1, &VAO);
-        glDeleteBuffers(1, &VBO);
+        glm::vec3 vertices[] = { a, b, c };
+        drawTransient(currentShaderProgram, color, vertices, 3, glm::vec3(xOffset, yOffset, zOffset));
     }
 };
 
@@ -135,15 +254,15 @@ public:
     }
 
     void draw(unsigned int currentShaderProgram, glm::vec4 color) const override{
-        t1.draw(currentShaderProgram, color);
-        t2.draw(currentShaderProgram, color);
+        drawWithOffset(currentShaderProgram, color, 0, 0, 0);
     }
+
+    //Both sub-triangles go out together as one piece of transient geometry
     void drawWithOffset(unsigned int currentShaderProgram, glm::vec4 color,
                         float xOffset, float yOffset, float zOffset) const override{
-        t1.drawWithOffset(currentShaderProgram, color, xOffset, yOffset, zOffset);
-        t2.drawWithOffset(currentShaderProgram, color, xOffset, yOffset, zOffset);
+        glm::vec3 vertices[] = { t1.a, t1.b, t1.c, t2.a, t2.b, t2.c };
+        drawTransient(currentShaderProgram, color, vertices, 6, glm::vec3(xOffset, yOffset, zOffset));
     }
-
 };
 
 //Fundamental shaders and rendering
@@ -153,20 +272,338 @@ extern const char* backgroundVertexShader;
 extern const char* backgroundFragmentShader;
 extern const char* uiVertexShaderSource;
 extern const char* uiFragmentShaderSource;
+extern const char* instancedVertexShaderSource;
+extern const char* instancedFragmentShaderSource;
+extern const char* skyboxVertexShader;
+extern const char* skyboxFragmentShader;
+extern const char* depthVertexShaderSource;
+extern const char* depthFragmentShaderSource;
+extern const char* shadowVertexShaderSource;
+extern const char* gBufferFragmentShaderSource;
+extern const char* deferredLightingFragmentShaderSource;
+
+//Shadow cascades of the scene light; see shadowsEnabled
+const int SHADOW_CASCADES = 4;
+
+//Per-frame globals shared by every engine shader through one std140 uniform block
+//("FrameGlobals"), filled once in engineBeginFrame. Member order and vec4 padding
+//must match the GLSL declaration, which the shader prelude gives every engine shader
+struct FrameGlobals {
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::mat4 viewProjection;
+    glm::vec4 cameraPosition;
+    glm::vec4 lightPosition;
+    glm::vec4 clusterScale; // froxels per framebuffer pixel (xy); log(depth) to slice (scale, bias)
+    glm::mat4 shadowMatrices[SHADOW_CASCADES]; // world to shadow atlas coordinates
+    glm::vec4 cascadeSplits; // far distance of each cascade from the camera; w is 0 without shadows
+};
+
+const unsigned int FRAME_GLOBALS_BINDING = 0;
+extern unsigned int frameGlobalsUBO;
+
+//Scene light position, uploaded with the frame globals
+extern glm::vec3 sceneLightPos;
+
+//View frustum as six inward-facing planes (xyz normal, w distance), extracted from a
+//view-projection matrix; used to skip Physicals that cannot appear on screen
+struct Frustum {
+    glm::vec4 planes[6];
+
+    static Frustum fromMatrix(const glm::mat4& viewProjection);
+
+    //Conservative box test: true unless the box lies entirely outside one plane
+    [[nodiscard]] bool intersects(const glm::vec3& minBounds, const glm::vec3& maxBounds) const;
+};
+
+//Frustum of the current frame's camera, rebuilt in engineBeginFrame
+extern Frustum viewFrustum;
+extern bool frustumCullingEnabled;
+
+//Software occlusion culling (off by default): engineBeginFrame rasterises every Physical
+//marked isOccluder into a small CPU depth buffer, split into tiles across the worker threads,
+//and drawScene skips Physicals whose bounds are hidden behind it. No GL involved
+extern bool occlusionCullingEnabled;
+
+//Level of detail: drawScene picks a simplified mesh from each Physical's projected
+//diameter. Level 1 starts below lodPixelSize pixels and every further level at half the
+//size of the one before; a level is only left once the size is LOD_HYSTERESIS beyond
+//the boundary, so objects hovering near one do not flicker between meshes
+extern bool lodEnabled;
+extern float lodPixelSize;
+const float LOD_HYSTERESIS = 0.15f;
+
+//Rebuilds the occlusion buffer from physicalWorld for the given camera
+void buildOcclusionBuffer(const glm::mat4& viewProjection);
+
+//True if the world-space box is entirely behind the occluders in the last buffer built
+bool isOccluded(const glm::vec3& minBounds, const glm::vec3& maxBounds);
+
+//Point lights, shaded with clustered forward lighting. Each frame the view frustum is split
+//into CLUSTER_TILES_X x CLUSTER_TILES_Y screen tiles by CLUSTER_SLICES depth slices
+//(exponential between the clip planes); every light in view is assigned to the froxels its
+//sphere touches, four lights per SIMD test and one depth slice per worker job. The lists go
+//to the lit shaders as texture buffers on units LIGHT_TEXTURE_UNIT to LIGHT_TEXTURE_UNIT + 2,
+//so a pixel only loops over the lights of its own froxel. sceneLightPos remains the key light
+struct PointLight {
+    glm::vec3 position;
+    float radius; // no contribution at or beyond this distance
+    glm::vec3 colour;
+    float intensity;
+};
+extern std::vector<PointLight> pointLights;
+
+const int CLUSTER_TILES_X = 16;
+const int CLUSTER_TILES_Y = 9;
+const int CLUSTER_SLICES = 24;
+const int MAX_VISIBLE_LIGHTS = 4096; // lights beyond this many in view are dropped
+const unsigned int LIGHT_TEXTURE_UNIT = 1;
+
+//Creates the light buffers and points the lit programs' samplers at them
+void initLighting();
+
+//Assigns the lights in viewFrustum to froxels for the given view matrix and uploads them
+void updateLightClusters(const glm::mat4& view);
+
+//Shadows from the scene light (off by default), treated as a directional light shining from
+//sceneLightPos towards the origin. Each cascade is a light-space box centred on the camera,
+//snapped to a coarse grid, with one tile of a depth atlas. Physicals marked isStatic are
+//drawn into a cached copy of the atlas only when their cascade's box moves or a static
+//Physical is added, removed or moved; every cascade update copies that cache into the live
+//atlas and draws the dynamic Physicals on top. Cascade 0 updates every frame and cascade n
+//every 2^n frames, staggered so the distant cascades never update on the same frame
+extern bool shadowsEnabled;
+const int SHADOW_TILE_SIZE = 1024; // the atlas is 2x2 tiles
+const float SHADOW_CASCADE_SPLITS[SHADOW_CASCADES] = { 15.0f, 50.0f, 150.0f, 500.0f };
+const float SHADOW_CASTER_RANGE = 500.0f; // how far towards the light casters are still drawn
+const unsigned int SHADOW_TEXTURE_UNIT = LIGHT_TEXTURE_UNIT + 6; // after the G-buffer's units
+
+//Points the lit programs' shadow samplers at SHADOW_TEXTURE_UNIT
+void initShadows();
+
+//Redraws the cascades due this frame and fills the shadow members of globals
+void updateShadowMaps(FrameGlobals& globals);
+
+//Redraws the cached static shadows on the next update; only needed after editing a static
+//Physical's shapes in place, since adding, removing, (un)marking or moving one, and changes
+//to its mesh vector, are picked up automatically
+void invalidateStaticShadows();
 
 //Shader programs, VAOs, VBOs
 extern unsigned int shaderProgram;
 extern unsigned int backgroundShaderProgram;
 extern unsigned int backgroundVAO, backgroundVBO;
 extern unsigned int crosshairVAO, crosshairVBO, uiShaderProgram;
+extern unsigned int instancedShaderProgram;
+extern unsigned int depthShaderProgram;
+extern unsigned int shadowShaderProgram;
+extern unsigned int gBufferShaderProgram;
+extern unsigned int deferredLightingShaderProgram;
 extern GLFWwindow* window;
 
+//Program building. submitProgram starts compiling and linking (or loads a cached driver
+//binary) without waiting for the result; with KHR_parallel_shader_compile the driver
+//works on every submitted program at once. finishPrograms then checks compile and link
+//status once per program, printing any error log, and saves fresh binaries to the cache.
+//Submitted programs can be used before finishPrograms; the driver waits for them.
+//Sources without a #version line (the engine's own) are compiled after the shader prelude:
+//the GLSL version, #defines for engine constants (SHADOW_CASCADES, CLUSTER_TILES_X/Y,
+//CLUSTER_SLICES) and the FrameGlobals block, plus pointLighting() and sceneShadow() for
+//fragment stages.
+//Sources with their own #version are compiled unchanged.
+//The binary cache lives under programCacheDirectory, keyed by the sources, the prelude and
+//the GL vendor/renderer/version strings, so a driver update simply misses
+extern std::string programCacheDirectory;
+unsigned int submitProgram(const char* vertexSource, const char* fragmentSource);
+void finishPrograms();
+
+//submitProgram followed by finishPrograms
+unsigned int buildProgram(const char* vertexSource, const char* fragmentSource);
+
+//Prints how many programs came from the cache or were compiled, and the time spent building
+//them; startEngine calls it once every program is ready, showing a cold or warm start
+void logProgramStats();
+
 unsigned int createShaderProgram();
 unsigned int createBackgroundShaderProgram();
 unsigned int createUIShaderProgram();
+unsigned int createInstancedShaderProgram();
+unsigned int createDepthShaderProgram();
 void framebuffer_size_callback(GLFWwindow* currentWindow, int width, int height);
+
+//Current framebuffer size in pixels (differs from the window size on high-DPI displays)
+extern int framebufferWidth, framebufferHeight;
 void renderPauseMenu(unsigned int pauseShaderProgram);
 
+//Per-instance attributes for the instanced program, uploaded as-is (116 bytes each).
+//The normal matrix is the inverse transpose of the model's upper 3x3, precomputed on the
+//CPU once per instance rather than per vertex
+struct InstanceData {
+    glm::mat4 model;
+    glm::vec4 colour;
+    glm::mat3 normalMatrix;
+
+    static InstanceData make(const glm::mat4& model, glm::vec4 colour);
+};
+
+//Interleaved position/normal vertices (6 floats each) with a triangle-list index buffer
+struct IndexedMesh {
+    std::vector<float> vertices;
+    std::vector<uint32_t> indices;
+
+    //Indexes a flat triangle list, merging vertices whose position and normal match exactly
+    static IndexedMesh weld(const std::vector<float>& triangleList);
+
+    [[nodiscard]] size_t vertexCount() const { return vertices.size() / 6; }
+    [[nodiscard]] size_t triangleCount() const { return indices.size() / 3; }
+
+    bool operator==(const IndexedMesh& other) const {
+        return vertices == other.vertices && indices == other.indices;
+    }
+};
+
+//GPU vertex layouts for mesh batches. Float is 24 bytes per vertex (float position and
+//normal). Compact is 12 bytes: 16-bit positions normalised to the mesh's bounding box
+//plus a GL_INT_2_10_10_10_REV normal; the vertex shaders rebuild the position from the
+//uPositionOrigin/uPositionExtent uniforms. Precision is 1/65535 of the box size per axis
+enum class VertexFormat { Float = 0, Compact = 1 };
+
+//Static mesh batch: a list of shapes compiled into one indexed position/normal mesh in
+//object space, so the whole mesh goes out in a single glDrawElements call. Indices are
+//uploaded as 16-bit whenever the vertex count allows. The CPU-side data is built on
+//construction; the GPU upload happens lazily on first bind.
+//Each batch also owns a per-instance buffer (InstanceData) for instanced drawing
+class MeshBatch {
+public:
+    //Welds a flat triangle list (as produced by compileShapes)
+    explicit MeshBatch(const std::vector<float>& triangleList, VertexFormat format = VertexFormat::Float);
+    explicit MeshBatch(IndexedMesh mesh, VertexFormat format = VertexFormat::Float);
+    ~MeshBatch();
+    MeshBatch(const MeshBatch&) = delete;
+    MeshBatch& operator=(const MeshBatch&) = delete;
+
+    //Flattens shapes into a triangle list in the interleaved position/normal layout
+    static std::vector<float> compileShapes(const std::vector<std::shared_ptr<Shape>>& shapes);
+
+    void bind();
+
+    //Draws the whole mesh once; expects the batch to be bound
+    void draw();
+
+    //Sets the program's position decode uniforms for this batch's vertex format; needed
+    //before drawing it with any program
+    void setDecodeUniforms(ShaderProgram& program) const;
+
+    //Uploads per-instance data and draws that many copies;
+    //expects the batch to be bound and an instanced program in use
+    void drawInstanced(const InstanceData* instanceData, int instanceCount);
+
+    [[nodiscard]] int getVertexCount() const { return static_cast<int>(mesh.vertexCount()); }
+    [[nodiscard]] int getIndexCount() const { return static_cast<int>(mesh.indices.size()); }
+    [[nodiscard]] int getTriangleCount() const { return static_cast<int>(mesh.triangleCount()); }
+    [[nodiscard]] const IndexedMesh& getMesh() const { return mesh; }
+    [[nodiscard]] VertexFormat getFormat() const { return format; }
+
+    //Small unique id, used to group draws of the same mesh in render queue sort keys
+    [[nodiscard]] unsigned int getId() const { return id; }
+
+    //Number of detail levels including this mesh (level 0). The simplified levels are
+    //generated on first use, each with roughly half the triangles of the one before
+    int getLodCount();
+
+    //Simplified batch for level 1 .. getLodCount() - 1
+    const std::shared_ptr<MeshBatch>& getLod(int level);
+
+    //True once the detail levels exist; from then on getLodCount and getLod only read,
+    //so worker threads may call them
+    [[nodiscard]] bool lodsReady() const { return lodsBuilt; }
+
+private:
+    IndexedMesh mesh;
+    VertexFormat format;
+    glm::vec3 positionOrigin = glm::vec3(0.0f);
+    glm::vec3 positionExtent = glm::vec3(1.0f);
+    bool uploaded = false;
+    unsigned int id;
+
+    unsigned int VAO = 0;
+    unsigned int VBO = 0;
+    unsigned int EBO = 0;
+    unsigned int indexType = 0; // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT, chosen on upload
+
+    unsigned int instanceVBO = 0;
+    size_t instanceCapacity = 0;
+
+    std::vector<std::shared_ptr<MeshBatch>> lods;
+    bool lodsBuilt = false;
+};
+
+//Quadric error edge-collapse simplification. Coincident positions are welded first and
+//open borders are weighted so they stay put; stops at targetTriangles or when nothing
+//more can collapse
+IndexedMesh simplifyMesh(const IndexedMesh& mesh, size_t targetTriangles);
+
+//Reorders triangles for the GPU's post-transform vertex cache (Forsyth's linear-speed
+//algorithm over a simulated 32-entry LRU cache), then renumbers vertices in first-use
+//order so vertex fetches walk the buffer forwards
+void optimizeMesh(IndexedMesh& mesh);
+
+//Average cache misses per triangle on a simulated FIFO post-transform cache: 3.0 means
+//every vertex is transformed again, well-ordered meshes get close to 0.5-0.7
+float computeACMR(const IndexedMesh& mesh, int cacheSize = 16);
+
+//Instanced rendering
+
+//Returns the shared batch for this geometry, creating it if no live batch has identical
+//vertices and format. Physicals built from the same geometry therefore share one batch
+std::shared_ptr<MeshBatch> registerMesh(const std::vector<std::shared_ptr<Shape>>& shapes,
+                                        VertexFormat format = VertexFormat::Float);
+
+//Prints the combined ACMR of every batch registerMesh has built, before and after
+//optimizeMesh reordered it
+void logMeshStats();
+
+//Queues one copy of a registered mesh for this frame through the render queue with the
+//instanced program, in the translucent pass if colour is partly transparent (as drawScene does)
+void submitInstance(const std::shared_ptr<MeshBatch>& batch, const glm::mat4& model, glm::vec4 colour);
+void submitInstance(const std::shared_ptr<MeshBatch>& batch, glm::vec3 offset, glm::vec4 colour);
+
+//Render queue
+
+//Passes in execution order. Opaque draws front-to-back for early-z; Sky follows it at max
+//depth with GL_LEQUAL, so only pixels the world left uncovered are shaded (the skybox or
+//background gradient goes first in it, once per frame); Translucent and Overlay blend
+//back-to-front, Overlay without depth testing (e.g. the pause overlay)
+enum class RenderPass { Opaque = 0, Sky = 1, Translucent = 2, Overlay = 3 };
+
+//Depth pre-pass: when enabled, flushRenderQueue first draws every opaque command into
+//the depth buffer only (depthShaderProgram, instanced from the same batches), then runs
+//the lit opaque pass with GL_LEQUAL and depth writes off, so each pixel is shaded once.
+//Costs a second round of vertex work; switchable at any time
+extern bool depthPrepassEnabled;
+
+//Deferred shading (off by default; chosen at startEngine, so set it beforehand like
+//skyboxEnabled). Opaque commands for shaderProgram or instancedShaderProgram then only write
+//albedo (Physical::colour) and normal into a G-buffer; one full-screen pass lights each
+//covered pixel once, looping over its froxel's point lights, and writes the scene depth
+//back so the sky, translucent and overlay passes follow unchanged. Opaque commands with
+//other programs are still drawn forward after it. Replaces the depth pre-pass
+extern bool deferredShadingEnabled;
+const unsigned int GBUFFER_TEXTURE_UNIT = LIGHT_TEXTURE_UNIT + 3;
+
+//Creates the G-buffer at the framebuffer size and points the lighting program at it
+void initDeferredShading();
+
+//Records a draw for this frame under a packed 64-bit sort key (pass, program, mesh, depth).
+//Commands for the instanced program that share a mesh are merged into one instanced call;
+//other programs draw the mesh with their uColor/uModel/uNormalMatrix uniforms
+void submitRenderCommand(RenderPass pass, unsigned int program, const std::shared_ptr<MeshBatch>& batch,
+                         const glm::mat4& model, glm::vec4 colour);
+
+//Radix-sorts the frame's commands and draws them pass by pass, changing state only between
+//runs. The frame's sky is drawn by the first flush, once its opaque commands are done
+void flushRenderQueue();
+
 //Physical class for 3D objects
 class Physical {
 public:
@@ -180,6 +617,24 @@ public:
     float y = 0;
     float z = 0;
 
+    //Euler angles in radians (applied Y, X, then Z) and per-axis scale; rendering only,
+    //collision bounds below still use the unrotated, unscaled mesh
+    glm::vec3 rotation = glm::vec3(0.0f);
+    glm::vec3 scale = glm::vec3(1.0f);
+
+    //Large, solid Physicals (ground, walls, big slabs) worth rasterising for occlusion culling
+    bool isOccluder = false;
+
+    //Rarely moves; its shadow is kept in the cached shadow atlas and only redrawn when it
+    //changes (see shadowsEnabled and invalidateStaticShadows)
+    bool isStatic = false;
+
+    //Detail level drawScene picked for this Physical last frame; 0 is the full mesh
+    int lodLevel = 0;
+
+    //GPU layout for this Physical's mesh; changing it re-registers the batch on next use
+    VertexFormat vertexFormat = VertexFormat::Float;
+
     float width;
     float height;
     float depth;
@@ -187,13 +642,46 @@ public:
     Physical(const std::vector<std::shared_ptr<Shape>>& initMesh, glm::vec4 colour) :
             mesh(initMesh), colour(colour){
         computeBounds();
+        compileMesh();
+    }
 
+    //a later static Physical may reuse this address, so the cached shadows can't rely on it
+    ~Physical(){
+        if (isStatic) invalidateStaticShadows();
     }
 
-    void draw(unsigned int currentShaderProgram){
-        for (const auto& shape : mesh) {
-            shape->drawWithOffset(currentShaderProgram, colour, x, y, z);
-        }
+    //Object-to-world transform from position, rotation and scale
+    [[nodiscard]] glm::mat4 getModelMatrix() const;
+
+    //World-space box enclosing the transformed mesh bounds
+    void getWorldBounds(glm::vec3& minOut, glm::vec3& maxOut) const;
+
+    //Draws the whole mesh with one call; the transform is applied in the vertex shader
+    void draw(unsigned int currentShaderProgram);
+
+    //True if the batch matches the current mesh, so getBatch will not rebuild (or write) it
+    [[nodiscard]] bool isMeshCompiled() const;
+
+    //Batch shared by every Physical with the same geometry (used by drawScene for instancing)
+    const std::shared_ptr<MeshBatch>& getBatch(){
+        compileMesh();
+        return batch;
+    }
+
+    //Batch for a detail level, clamped to the levels the mesh has. Level 0 never builds the
+    //detail levels; higher levels do on first use, so off the main thread only once lodsReady
+    const std::shared_ptr<MeshBatch>& getLodBatch(int level){
+        compileMesh();
+        if (level <= 0) return batch;
+        level = std::min(level, batch->getLodCount() - 1);
+        if (level <= 0) return batch;
+        return batch->getLod(level);
+    }
+
+    //Forces a rebuild of the mesh batch on the next draw; only needed after editing a shape
+    //in place, since adding, removing or replacing shapes in "mesh" is picked up automatically
+    void invalidateMesh(){
+        compiledShapes.clear();
     }
 
     void applyForce(glm::vec3 force){
@@ -225,6 +713,16 @@ public:
     }
 
 private:
+    std::shared_ptr<MeshBatch> batch;
+    std::vector<const Shape*> compiledShapes;
+
+    //mesh-space bounds, kept for culling
+    glm::vec3 localMin = glm::vec3(0.0f);
+    glm::vec3 localMax = glm::vec3(0.0f);
+
+    //Re-registers the batch if the mesh vector no longer matches what was last compiled
+    void compileMesh();
+
     void computeBounds() {
         glm::vec3 minBounds = glm::vec3(std::numeric_limits<float>::max());
         glm::vec3 maxBounds = glm::vec3(std::numeric_limits<float>::lowest());
@@ -236,6 +734,10 @@ private:
             }
         }
 
+        if (minBounds.x > maxBounds.x) minBounds = maxBounds = glm::vec3(0.0f); // no vertices
+
+        localMin = minBounds;
+        localMax = maxBounds;
         width = maxBounds.x - minBounds.x;
         height = maxBounds.y - minBounds.y;
         depth = maxBounds.z - minBounds.z;
@@ -250,9 +752,33 @@ void engineBeginFrame();
 void engineEndFrame();
 void handleUI();
 
+//Dynamic resolution (off by default; switchable at any time). The 3D scene is rendered
+//into an offscreen framebuffer at resolutionScale times the framebuffer size, then upscaled
+//to the window before handleUI draws the UI at native resolution. Every frame the scale
+//moves towards keeping the scene's GPU time (GL_TIME_ELAPSED queries, read a few frames
+//late so they never stall) under targetFrameMilliseconds, between minResolutionScale and
+//maxResolutionScale (at most 1). It only rises while the CPU frame time is within budget too
+extern bool dynamicResolutionEnabled;
+extern float targetFrameMilliseconds;
+extern float minResolutionScale;
+extern float maxResolutionScale;
+extern float resolutionScale;
+
+//Size the 3D scene is rendered at this frame, and the framebuffer it goes to (0 when it is
+//drawn straight to the window)
+extern int renderWidth, renderHeight;
+extern unsigned int sceneFramebuffer;
+
+//Upscales the scene to the window and makes the window the target for the rest of the
+//frame (sceneFramebuffer 0, renderWidth/renderHeight and the frame globals at native size),
+//so commands queued after it draw over the UI; handleUI calls it after flushing the queue,
+//and engineEndFrame if the game skipped handleUI
+void resolveScene();
+
 //Skyboxes
 unsigned int initSkybox(const char* faces[6]);
 void renderSkybox();
+void renderBackground();
 
 //PHYSICS
 
@@ -262,6 +788,18 @@ std::vector<Physical*> detectCollisionWithPhysical(Physical* physical);
 //Physics simulation
 void simulateFrame();
 
+//Pipelined frames (off by default; switchable at any time). engineEndFrame starts the next
+//frame's simulateFrame on its own thread, then flushes what is left of the render queue and
+//swaps buffers while it runs; engineUpdate waits for it. There is no separate render copy
+//of physicalWorld, so the overlap is limited to that last flush and the swap (which may
+//block on vsync); drawScene and everything before it still run after the simulation.
+//The simulation runs before the next engineUpdate measures its frame time, so it steps
+//with the previous frame's deltaTime: one frame of lag in frame-time changes
+extern bool pipelinedSimulationEnabled;
+
+//Blocks until a simulation started by engineEndFrame has finished; returns at once otherwise
+void waitForSimulation();
+
 //Time function
 float getDeltaTime();
 
@@ -290,4 +828,5 @@ void keyboardInput(GLFWwindow* currentWindow);
 
 void startEngine();
 void engineUpdate();
+//Physicals outside viewFrustum or hidden by occluders are skipped (counted in frameStats)
 void drawScene();